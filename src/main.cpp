@@ -4,20 +4,49 @@
 #include <string>
 #include <vector>
 #include <zlib.h>
+#include <curl/curl.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <sstream>
 #include <iomanip>
 #include <algorithm> // Required for sorting
 #include <map>
-#include <cstdlib> // Required for system()
+#include <list>
+#include <unordered_map>
+#include <set>
+#include <queue>
+#include <string_view>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <csignal>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <mutex>
 
 using namespace std;
 namespace fs = std::filesystem;
 
+// Repository metadata directory; upload-pack points this at a bare repository
+fs::path gitDir = ".git";
+
 
 
 // Convert raw 20-byte SHA string to 40-char Hex string
-string shaToHex(const string& rawSha) {
+string shaToHex(string_view rawSha) {
     stringstream ss;
     for (unsigned char c : rawSha) {
         ss << hex << setw(2) << setfill('0') << (int)c;
@@ -25,6 +54,17 @@ string shaToHex(const string& rawSha) {
     return ss.str();
 }
 
+// Convert 40-char Hex SHA string to raw 20-byte SHA string
+string hexToSha(const string& hexSha) {
+    string raw(20, '\0');
+    for (int i = 0; i < 20; ++i) raw[i] = (char)stoi(hexSha.substr(i * 2, 2), nullptr, 16);
+    return raw;
+}
+
+// Defined with the object store code: stores "header + body" as a loose
+// object unless it already exists
+void writeObjectWithSha(string_view header, string_view body, const string& shaHex);
+
 // Write a git object (Blob or Tree or Commit) to .git/objects
 // Returns the raw 20-byte SHA-1
 string writeObject(const string& type, const string& content) {
@@ -36,303 +76,3229 @@ string writeObject(const string& type, const string& content) {
     unsigned char hash[20];
     SHA1(reinterpret_cast<const unsigned char*>(store.data()), store.size(), hash);
     string sha1Raw((char*)hash, 20);
-    string sha1Hex = shaToHex(sha1Raw);
 
-    // 3. Compress using Zlib
-    uLongf compressedSize = compressBound(store.size());
-    vector<Bytef> compressedData(compressedSize);
-    if (compress(compressedData.data(), &compressedSize, reinterpret_cast<const Bytef*>(store.data()), store.size()) != Z_OK) {
-        throw runtime_error("Compression failed");
-    }
+    // 3. Compress and write, skipping objects that exist already. Those may be
+    // hardlinked read-only into another repository, so they are never rewritten.
+    writeObjectWithSha(header, content, shaToHex(sha1Raw));
+    return sha1Raw;
+}
+
+// Defined with the remote protocol code: downloads objects a partial clone
+// left out. Returns false when the repository has no promisor remote.
+bool fetchMissingObjects(const vector<string>& shas);
+
+// Defined with the pack storage code: looks `sha` up in the pack indexes,
+// reading the object or only checking that it is there
+bool readPackedObject(const string& sha, string& out);
+bool hasPackedObject(const string& sha);
+
+// Defined with the config code: value of "section.key" from .git/config
+string configValue(const string& key, const string& fallback);
+
+fs::path objectPath(const string& sha) {
+    return gitDir / "objects" / sha.substr(0, 2) / sha.substr(2);
+}
+
+// Set when objects/info/alternates is rewritten so the next lookup reloads it
+bool alternatesChanged = false;
+
+// Object directories searched on reads: our own, then the stores listed in
+// objects/info/alternates, recursively, since a borrowed store may borrow from
+// another. Relative entries are relative to the store that lists them. The
+// chain is parsed once per repository and cached for the rest of the process.
+const vector<fs::path>& objectDirectories() {
+    static vector<fs::path> dirs;
+    static fs::path loadedFor;
+    if (!dirs.empty() && loadedFor == gitDir && !alternatesChanged) return dirs;
+
+    const int maxDepth = 5; // Same nesting limit as git
+    dirs.clear();
+    set<fs::path> seen;
+    function<void(const fs::path&, int)> add = [&](const fs::path& dir, int depth) {
+        fs::path normalized = fs::weakly_canonical(dir);
+        if (!seen.insert(normalized).second) return; // Cycle or duplicate
+        dirs.push_back(dir);
+        if (depth >= maxDepth) return;
+
+        ifstream alternates(dir / "info/alternates");
+        string line;
+        while (getline(alternates, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            fs::path alt = line;
+            if (alt.is_relative()) alt = dir / alt;
+            if (fs::is_directory(alt)) add(alt, depth + 1);
+            else cerr << "[WARN] Ignoring missing alternate object store " << alt << endl;
+        }
+    };
+    add(gitDir / "objects", 0);
+    loadedFor = gitDir;
+    alternatesChanged = false;
+    return dirs;
+}
+
+string readLooseObject(const fs::path& filePath) {
+    ifstream file(filePath, ios::binary);
+    if (!file.is_open()) throw runtime_error("Failed to open object file");
+
+    vector<char> compressed((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    file.close();
+
+    z_stream zs = {0}; // Zero-init
+    if (inflateInit(&zs) != Z_OK) throw runtime_error("Failed to initialize zlib");
+
+    zs.avail_in = compressed.size();
+    zs.next_in = reinterpret_cast<Bytef*>(compressed.data());
+
+    vector<char> buffer(8192);
+    string decompressed;
+    int ret;
 
-    // 4. Write to Disk
-    string dirName = sha1Hex.substr(0, 2);
-    string fileName = sha1Hex.substr(2);
-    fs::path dirPath = ".git/objects/" + dirName;
+    do {
+        zs.avail_out = buffer.size();
+        zs.next_out = reinterpret_cast<Bytef*>(buffer.data());
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (decompressed.size() < zs.total_out) {
+            decompressed.append(buffer.data(), zs.total_out - decompressed.size());
+        }
+    } while (ret != Z_STREAM_END);
     
-    if (!fs::exists(dirPath)) {
-        fs::create_directories(dirPath);
+    inflateEnd(&zs);
+    return decompressed;
+}
+
+// Find an object as a loose file in any object directory, or in a pack
+bool lookupObject(const string& sha, string& out) {
+    for (const auto& dir : objectDirectories()) {
+        fs::path filePath = dir / sha.substr(0, 2) / sha.substr(2);
+        if (fs::exists(filePath)) {
+            out = readLooseObject(filePath);
+            return true;
+        }
+    }
+    return readPackedObject(sha, out);
+}
+
+bool objectExists(const string& sha) {
+    for (const auto& dir : objectDirectories()) {
+        if (fs::exists(dir / sha.substr(0, 2) / sha.substr(2))) return true;
+    }
+    return hasPackedObject(sha); // Index lookup only; the object is not inflated
+}
+
+// Read and decompress an object (used by cat-file and ls-tree)
+string readObject(const string& sha) {
+    string content;
+    if (lookupObject(sha, content)) return content;
+    if (fetchMissingObjects({sha}) && lookupObject(sha, content)) return content;
+    throw runtime_error("Object not found: " + sha);
+}
+
+// Struct to hold tree entries for sorting
+struct TreeEntry {
+    string name;
+    string mode;     // "100644" or "40000"
+    string shaRaw;   // 20-byte raw SHA
+
+    // Sorting operator required by Git (sort by name)
+    bool operator<(const TreeEntry& other) const {
+        return name < other.name;
+    }
+};
+
+// Parse the entries of a tree object
+vector<TreeEntry> parseTree(const string& treeSha) {
+    string content = readObject(treeSha);
+    vector<TreeEntry> entries;
+    size_t i = content.find('\0') + 1; // Skip header
+    while (i < content.size()) {
+        size_t spacePos = content.find(' ', i);
+        size_t nullPos = content.find('\0', spacePos);
+        TreeEntry te;
+        te.mode = content.substr(i, spacePos - i);
+        te.name = content.substr(spacePos + 1, nullPos - (spacePos + 1));
+        te.shaRaw = content.substr(nullPos + 1, 20);
+        entries.push_back(te);
+        i = nullPos + 1 + 20;
+    }
+    return entries;
+}
+
+// Recursive function to build trees
+string writeTree(const fs::path& directory) {
+    vector<TreeEntry> entries;
+
+    for (const auto& entry : fs::directory_iterator(directory)) {
+        string name = entry.path().filename().string();
+        
+        // Ignore .git directory
+        if (name == ".git") continue;
+
+        TreeEntry te;
+        te.name = name;
+
+        if (entry.is_directory()) {
+            te.mode = "40000";
+            // Recursively write the subdirectory tree
+            te.shaRaw = writeTree(entry.path());
+        } else {
+            te.mode = "100644"; // Assuming regular file
+            
+            // Read file content
+            ifstream file(entry.path(), ios::binary);
+            string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+            
+            // Write blob and get SHA
+            te.shaRaw = writeObject("blob", content);
+        }
+        entries.push_back(te);
+    }
+
+    // Sort entries alphabetically
+    sort(entries.begin(), entries.end());
+
+    // Construct the Tree Object content
+    string treeContent;
+    for (const auto& e : entries) {
+        // Format: <mode> <name>\0<20_byte_sha>
+        treeContent += e.mode + " " + e.name + '\0' + e.shaRaw;
+    }
+
+    // Write the tree object itself
+    return writeObject("tree", treeContent);
+}
+
+// --- Helper Functions ---
+
+string typeToString(int type) {
+    switch (type) {
+        case 1: return "commit";
+        case 2: return "tree";
+        case 3: return "blob";
+        case 4: return "tag";
+        case 6: return "ofs_delta";
+        case 7: return "ref_delta";
+        default: return "unknown";
     }
+}
+
+int typeFromString(const string& type) {
+    if (type == "commit") return 1;
+    if (type == "tree") return 2;
+    if (type == "blob") return 3;
+    if (type == "tag") return 4;
+    throw runtime_error("Unknown object type: " + type);
+}
+
+// Stores "header + body" as a loose object. The two parts are compressed as
+// one stream, so callers holding the data separately never concatenate it.
+void writeObjectWithSha(string_view header, string_view body, const string& shaHex) {
+    string dirName = shaHex.substr(0, 2);
+    string fileName = shaHex.substr(2);
+    fs::path dirPath = gitDir / "objects" / dirName;
+    if (!fs::exists(dirPath)) fs::create_directories(dirPath);
+    if (fs::exists(dirPath / fileName)) return; // Content-addressed: already stored
 
-    ofstream outFile(dirPath / fileName, ios::binary);
-    if (!outFile.is_open()) throw runtime_error("Failed to write object file");
-    outFile.write(reinterpret_cast<const char*>(compressedData.data()), compressedSize);
+    z_stream zs = {};
+    if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) throw runtime_error("Compression failed");
+    vector<Bytef> compressedData(deflateBound(&zs, header.size() + body.size()));
+    zs.next_out = compressedData.data();
+    zs.avail_out = compressedData.size();
+    zs.next_in = (Bytef*)header.data();
+    zs.avail_in = header.size();
+    int ret = deflate(&zs, Z_NO_FLUSH);
+    zs.next_in = (Bytef*)body.data();
+    zs.avail_in = body.size();
+    if (ret == Z_OK) ret = deflate(&zs, Z_FINISH);
+    size_t compressedSize = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) throw runtime_error("Compression failed");
+
+    // Write under a private name and rename, so concurrent writers of the
+    // same object never expose a partial file
+    fs::path tmpPath = dirPath / ("tmp_obj_" + to_string(getpid()) + "_" + to_string(hash<thread::id>{}(this_thread::get_id())));
+    ofstream outFile(tmpPath, ios::binary);
+    outFile.write((const char*)compressedData.data(), compressedSize);
     outFile.close();
+    fs::rename(tmpPath, dirPath / fileName);
+}
+
+void writeObjectWithSha(const string& content, const string& shaHex) {
+    writeObjectWithSha({}, content, shaHex);
+}
+
+// "<n>[k|m|g]" as used by config values and filters
+size_t parseByteSize(const string& spec) {
+    size_t value = stoull(spec);
+    char unit = spec.empty() ? 0 : tolower(spec.back());
+    if (unit == 'k') value <<= 10;
+    else if (unit == 'm') value <<= 20;
+    else if (unit == 'g') value <<= 30;
+    return value;
+}
+
+// Closes a raw file descriptor when it goes out of scope
+struct FdGuard {
+    int fd;
+    explicit FdGuard(int fd) : fd(fd) {}
+    ~FdGuard() { if (fd >= 0) close(fd); }
+    FdGuard(const FdGuard&) = delete;
+    FdGuard& operator=(const FdGuard&) = delete;
+};
+
+void writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error(string("write failed: ") + strerror(errno));
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// --- DEBUG ENABLED NETWORKING ---
+
+// Receives response body bytes as they arrive from the network
+using ByteSink = function<void(const char* data, size_t len)>;
+
+struct CurlWriteContext {
+    const ByteSink* sink;
+    size_t received = 0;
+    exception_ptr error;
+};
+
+static size_t curlWriteCallback(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    auto* ctx = static_cast<CurlWriteContext*>(userdata);
+    size_t len = size * nmemb;
+    try {
+        (*ctx->sink)(ptr, len);
+    } catch (...) {
+        // Exceptions must not unwind through libcurl; abort the transfer instead
+        ctx->error = current_exception();
+        return 0;
+    }
+    ctx->received += len;
+    return len;
+}
+
+// Request bodies above this size are sent gzip-compressed (as git does)
+const size_t gzipRequestThreshold = 1024;
+
+// gzip container (windowBits 15 + 16) around a deflate stream
+string gzipBytes(const string& data) {
+    z_stream zs = {};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw runtime_error("zlib init failed");
+    }
+    string out(deflateBound(&zs, data.size()), '\0');
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.size();
+    zs.next_out = (Bytef*)out.data();
+    zs.avail_out = out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) throw runtime_error("gzip compression failed");
+    return out;
+}
+
+string gunzipBytes(const string& data) {
+    z_stream zs = {};
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) throw runtime_error("zlib init failed"); // +32: gzip or zlib header
+    zs.next_in = (Bytef*)data.data();
+    zs.avail_in = data.size();
+    string out;
+    int ret;
+    do {
+        char buf[65536];
+        zs.next_out = (Bytef*)buf;
+        zs.avail_out = sizeof(buf);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&zs);
+            throw runtime_error("Corrupt gzip data");
+        }
+        out.append(buf, sizeof(buf) - zs.avail_out);
+    } while (ret != Z_STREAM_END && (zs.avail_in > 0 || zs.avail_out == 0));
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END) throw runtime_error("Truncated gzip data");
+    return out;
+}
+
+// A libcurl easy handle kept for the whole process. libcurl keeps the
+// handle's connections open between transfers, so the rounds of a fetch
+// negotiation, lazy blob fetches and push discovery share one TCP/TLS
+// connection instead of paying for a handshake each.
+class HttpSession {
+public:
+    HttpSession() : curl(curl_easy_init(), curl_easy_cleanup) {
+        if (!curl) throw runtime_error("Failed to create HTTP handle");
+    }
+
+    // Streams the response body into `sink`. A null `postData` issues a GET.
+    // A `resumeFrom` of 0 or more makes it a resumable download: the body is
+    // requested from that byte on, and a transfer that stalls for a minute is
+    // aborted so the caller can retry instead of hanging. The range is sent as
+    // a plain Range header rather than CURLOPT_RESUME_FROM, which fails the
+    // transfer when the server answers 200; callers check responseCode().
+    void request(const string& url, const string* postData, const string& contentType, const vector<string>& extraHeaders, const ByteSink& sink, curl_off_t resumeFrom = -1) {
+        curl_easy_reset(curl.get()); // Clears options; the connection cache survives
+
+        CurlWriteContext ctx{&sink};
+        curl_slist* headers = nullptr;
+        string range = resumeFrom > 0 ? to_string(resumeFrom) + "-" : "";
+        curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl.get(), CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl.get(), CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(curl.get(), CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl.get(), CURLOPT_ACCEPT_ENCODING, ""); // Any encoding libcurl can decode
+        curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, curlWriteCallback);
+        curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &ctx);
+        if (resumeFrom >= 0) {
+            curl_easy_setopt(curl.get(), CURLOPT_ACCEPT_ENCODING, nullptr); // Byte ranges must address the raw file
+            if (!range.empty()) curl_easy_setopt(curl.get(), CURLOPT_RANGE, range.c_str());
+            curl_easy_setopt(curl.get(), CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt(curl.get(), CURLOPT_LOW_SPEED_TIME, 60L);
+        }
+        for (const auto& h : extraHeaders) headers = curl_slist_append(headers, h.c_str());
+        if (postData) {
+            headers = curl_slist_append(headers, ("Content-Type: " + contentType).c_str());
+            headers = curl_slist_append(headers, "Expect:"); // Skip the 100-continue round trip
+            curl_easy_setopt(curl.get(), CURLOPT_POST, 1L);
+            curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDS, postData->data());
+            curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)postData->size());
+        }
+        curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headers);
+
+        CURLcode res = curl_easy_perform(curl.get());
+        curl_slist_free_all(headers);
+
+        if (ctx.error) rethrow_exception(ctx.error);
+        if (res != CURLE_OK) {
+            cerr << "[ERROR] HTTP " << (postData ? "POST" : "GET") << " failed: " << curl_easy_strerror(res) << endl;
+            throw runtime_error(postData ? "HTTP POST failed" : "HTTP GET failed");
+        }
+        long newConnections = 0;
+        curl_easy_getinfo(curl.get(), CURLINFO_NUM_CONNECTS, &newConnections);
+        cerr << "[DEBUG] Received " << ctx.received << " bytes" << (newConnections ? "." : " (connection reused).") << endl;
+    }
+
+    // Status of the current or last response (0 before any headers arrived)
+    long responseCode() {
+        long code = 0;
+        curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &code);
+        return code;
+    }
+
+private:
+    unique_ptr<CURL, decltype(&curl_easy_cleanup)> curl;
+};
+
+// The session for the remote serving `url`, keyed by scheme://host[:port]
+HttpSession& httpSessionFor(const string& url) {
+    static bool curlReady = [] { return curl_global_init(CURL_GLOBAL_DEFAULT) == CURLE_OK; }();
+    if (!curlReady) throw runtime_error("libcurl initialization failed");
+
+    static map<string, unique_ptr<HttpSession>> sessions;
+    size_t schemeEnd = url.find("://");
+    size_t hostEnd = url.find('/', schemeEnd == string::npos ? 0 : schemeEnd + 3);
+    auto& session = sessions[url.substr(0, hostEnd)];
+    if (!session) session = make_unique<HttpSession>();
+    return *session;
+}
+
+void httpRequest(const string& url, const string* postData, const string& contentType, const vector<string>& extraHeaders, const ByteSink& sink) {
+    httpSessionFor(url).request(url, postData, contentType, extraHeaders, sink);
+}
+
+void httpGet(const string& url, const vector<string>& headers, const ByteSink& sink) {
+    cerr << "[DEBUG] GET Request: " << url << endl;
+    httpRequest(url, nullptr, "", headers, sink);
+}
+
+string httpGet(const string& url, const vector<string>& headers = {}) {
+    string content;
+    httpGet(url, headers, [&](const char* data, size_t len) { content.append(data, len); });
+    return content;
+}
+
+void httpPost(const string& url, const string& data, const string& contentType, const vector<string>& headers, const ByteSink& sink) {
+    cerr << "[DEBUG] POST Request: " << url << endl;
+    httpRequest(url, &data, contentType, headers, sink);
+}
+
+string httpPost(const string& url, const string& data, const string& contentType, const vector<string>& headers = {}) {
+    string content;
+    httpPost(url, data, contentType, headers, [&](const char* chunk, size_t len) { content.append(chunk, len); });
+    return content;
+}
+
+// --- Packfile Helpers ---
+
+string createPktLine(const string& data) {
+    stringstream ss;
+    ss << hex << setfill('0') << setw(4) << (data.size() + 4);
+    return ss.str() + data;
+}
+
+enum class PktType { Data, Flush, Delim, ResponseEnd };
+
+// Splits a byte stream into pkt-lines without buffering more than one packet.
+// A handler may call switchToRaw() to hand the rest of the stream (e.g. a
+// pack sent without side-band) to a plain byte sink.
+class PktLineReader {
+public:
+    using Handler = function<void(PktType type, string_view payload)>;
+
+    explicit PktLineReader(Handler handler) : handler(std::move(handler)) {}
+
+    void switchToRaw(ByteSink sink) { rawSink = std::move(sink); }
+
+    void feed(const char* data, size_t len) {
+        if (rawSink) { rawSink(data, len); return; }
+
+        // Only copy into the carry buffer when a packet straddles two chunks
+        size_t pos = 0;
+        while (!carry.empty() && pos < len) {
+            size_t need = carry.size() < 4 ? 4 - carry.size() : pendingLen - carry.size();
+            size_t take = min(need, len - pos);
+            carry.append(data + pos, take);
+            pos += take;
+            if (carry.size() == 4) pendingLen = max<size_t>(parseLength(carry.data()), 4);
+            if (carry.size() >= 4 && carry.size() == pendingLen) {
+                dispatch(carry.data(), carry.size());
+                carry.clear();
+            }
+        }
+        if (!carry.empty()) return;
+
+        while (pos < len) {
+            if (rawSink) { rawSink(data + pos, len - pos); return; }
+            if (len - pos < 4) break;
+            size_t pktLen = parseLength(data + pos);
+            if (pktLen < 4) { dispatch(data + pos, 4); pos += 4; continue; }
+            if (len - pos < pktLen) { pendingLen = pktLen; break; }
+            dispatch(data + pos, pktLen);
+            pos += pktLen;
+        }
+        carry.assign(data + pos, len - pos);
+        if (carry.size() >= 4) pendingLen = parseLength(carry.data());
+    }
+
+    // True if the stream stopped in the middle of a packet
+    bool hasPartialPacket() const { return !carry.empty(); }
+
+private:
+    static size_t parseLength(const char* p) {
+        size_t n = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = p[i];
+            n <<= 4;
+            if (c >= '0' && c <= '9') n |= c - '0';
+            else if (c >= 'a' && c <= 'f') n |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') n |= c - 'A' + 10;
+            else throw runtime_error("Invalid pkt-line length: " + string(p, 4));
+        }
+        if (n == 3) throw runtime_error("Invalid pkt-line length: 0003");
+        return n;
+    }
+
+    void dispatch(const char* pkt, size_t len) {
+        if (len == 4) {
+            size_t n = parseLength(pkt);
+            if (n == 0) return handler(PktType::Flush, {});
+            if (n == 1) return handler(PktType::Delim, {});
+            if (n == 2) return handler(PktType::ResponseEnd, {});
+        }
+        handler(PktType::Data, string_view(pkt + 4, len - 4));
+    }
+
+    Handler handler;
+    ByteSink rawSink;
+    string carry;          // Bytes of a packet split across feed() calls
+    size_t pendingLen = 0; // Total length of the packet in `carry`
+};
+
+// Routes one side-band-64k frame: channel 1 is pack data, 2 is progress
+// text for the user, 3 is a fatal error reported by the remote.
+void demuxSideBand(string_view pkt, const ByteSink& packSink) {
+    if (pkt.empty()) return;
+    char channel = pkt[0];
+    string_view payload = pkt.substr(1);
+    if (channel == 1) {
+        packSink(payload.data(), payload.size());
+    } else if (channel == 2) {
+        // Progress frames may split lines; only prefix the start of each line
+        static bool atLineStart = true;
+        string text;
+        for (char c : payload) {
+            if (atLineStart) text += "remote: ";
+            text += c;
+            atLineStart = (c == '\n' || c == '\r');
+        }
+        cerr << text;
+    } else if (channel == 3) {
+        throw runtime_error("remote error: " + string(payload));
+    } else {
+        throw runtime_error("Invalid side-band channel " + to_string((int)(unsigned char)channel));
+    }
+}
+
+// Rebuilds a delta's target from `base`. The output is allocated once at the
+// target size from the delta header and filled with memcpy straight from the
+// base and the delta. Every instruction is bounds-checked, so a corrupt delta
+// throws instead of reading or writing out of range.
+string applyDelta(string_view base, string_view delta) {
+    size_t pos = 0;
+    auto readSize = [&]() {
+        size_t value = 0;
+        int shift = 0;
+        unsigned char b;
+        do {
+            if (pos >= delta.size() || shift > 63) throw runtime_error("Corrupt delta: truncated header");
+            b = delta[pos++];
+            value |= (size_t)(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+        return value;
+    };
+    size_t srcSize = readSize();
+    size_t targetSize = readSize();
+    if (srcSize != base.size()) throw runtime_error("Corrupt delta: base size mismatch");
+
+    string result(targetSize, '\0');
+    char* out = result.data();
+    size_t written = 0;
+    while (pos < delta.size()) {
+        unsigned char cmd = delta[pos++];
+        if (cmd & 0x80) { // Copy
+            size_t copyOff = 0, copySize = 0;
+            for (int i = 0; i < 7; ++i) {
+                if (!(cmd & (1 << i))) continue;
+                if (pos >= delta.size()) throw runtime_error("Corrupt delta: truncated copy");
+                size_t byte = (unsigned char)delta[pos++];
+                if (i < 4) copyOff |= byte << (i * 8);
+                else copySize |= byte << ((i - 4) * 8);
+            }
+            if (copySize == 0) copySize = 0x10000;
+            if (copyOff > base.size() || copySize > base.size() - copyOff || copySize > targetSize - written) {
+                throw runtime_error("Corrupt delta: copy out of range");
+            }
+            memcpy(out + written, base.data() + copyOff, copySize);
+            written += copySize;
+        } else if (cmd > 0) { // Insert
+            if (cmd > delta.size() - pos || cmd > targetSize - written) throw runtime_error("Corrupt delta: insert out of range");
+            memcpy(out + written, delta.data() + pos, cmd);
+            written += cmd;
+            pos += cmd;
+        } else {
+            throw runtime_error("Corrupt delta: reserved opcode 0");
+        }
+    }
+    if (written != targetSize) throw runtime_error("Corrupt delta: target size mismatch");
+    return result;
+}
+
+// Delta that turns `base` into `target`, in the format applyDelta reads.
+// Base blocks of deltaBlockSize bytes are indexed by content; the target is
+// scanned for matches, which are extended in both directions and emitted as
+// copy ops. Unmatched bytes become insert ops.
+const size_t deltaBlockSize = 16;
+
+string createDelta(const string& base, const string& target) {
+    string delta;
+    auto putSize = [&](size_t size) {
+        do {
+            unsigned char b = size & 0x7f;
+            size >>= 7;
+            delta += (char)(size ? b | 0x80 : b);
+        } while (size);
+    };
+    putSize(base.size());
+    putSize(target.size());
+
+    unordered_map<string_view, vector<uint32_t>> index;
+    string_view baseView(base), targetView(target);
+    for (size_t off = 0; off + deltaBlockSize <= base.size(); off += deltaBlockSize) {
+        auto& offsets = index[baseView.substr(off, deltaBlockSize)];
+        if (offsets.size() < 64) offsets.push_back(off); // Cap work on repetitive input
+    }
+
+    string pending; // Literal bytes not yet written as insert ops
+    auto flushInsert = [&]() {
+        for (size_t i = 0; i < pending.size(); i += 127) {
+            size_t n = min<size_t>(127, pending.size() - i);
+            delta += (char)n;
+            delta.append(pending, i, n);
+        }
+        pending.clear();
+    };
+    auto putCopy = [&](size_t off, size_t size) {
+        while (size > 0) {
+            size_t chunk = min<size_t>(size, 0x10000);
+            string args;
+            unsigned char cmd = 0x80;
+            for (int i = 0; i < 4; ++i) {
+                if ((off >> (i * 8)) & 0xff) { cmd |= 1 << i; args += (char)(off >> (i * 8)); }
+            }
+            if (chunk != 0x10000) { // A zero size field means 0x10000
+                for (int i = 0; i < 3; ++i) {
+                    if ((chunk >> (i * 8)) & 0xff) { cmd |= 0x10 << i; args += (char)(chunk >> (i * 8)); }
+                }
+            }
+            delta += (char)cmd;
+            delta += args;
+            off += chunk;
+            size -= chunk;
+        }
+    };
+
+    size_t pos = 0;
+    while (pos < target.size()) {
+        size_t bestOff = 0, bestLen = 0;
+        if (pos + deltaBlockSize <= target.size()) {
+            auto it = index.find(targetView.substr(pos, deltaBlockSize));
+            if (it != index.end()) {
+                for (uint32_t off : it->second) {
+                    size_t len = deltaBlockSize;
+                    while (off + len < base.size() && pos + len < target.size() && base[off + len] == target[pos + len]) ++len;
+                    if (len > bestLen) { bestLen = len; bestOff = off; }
+                }
+            }
+        }
+        if (bestLen == 0) {
+            pending += target[pos++];
+            continue;
+        }
+        // Reclaim literal bytes that also precede the match in the base
+        while (bestOff > 0 && !pending.empty() && base[bestOff - 1] == pending.back()) {
+            pending.pop_back();
+            --bestOff;
+            --pos;
+            ++bestLen;
+        }
+        flushInsert();
+        putCopy(bestOff, bestLen);
+        pos += bestLen;
+    }
+    flushInsert();
+    return delta;
+}
+
+// --- Pack Storage ---
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    explicit MappedFile(const fs::path& path) {
+        FdGuard fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd.fd < 0) throw runtime_error("Failed to open " + path.string() + ": " + strerror(errno));
+        struct stat st;
+        if (fstat(fd.fd, &st) != 0) throw runtime_error("Failed to stat " + path.string());
+        len = st.st_size;
+        if (len == 0) return;
+        void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd.fd, 0);
+        if (p == MAP_FAILED) throw runtime_error("Failed to map " + path.string() + ": " + strerror(errno));
+        ptr = static_cast<const unsigned char*>(p);
+    }
+    ~MappedFile() { if (ptr) munmap(const_cast<unsigned char*>(ptr), len); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return ptr; }
+    size_t size() const { return len; }
+
+private:
+    const unsigned char* ptr = nullptr;
+    size_t len = 0;
+};
+
+// A z_stream that is initialised once and rewound with inflateReset for each
+// new stream; pack entries are often tiny, so per-entry inflateInit/inflateEnd
+// (and their allocations) would dominate.
+class Inflater {
+public:
+    Inflater() {
+        if (inflateInit(&zs) != Z_OK) throw runtime_error("zlib init failed");
+    }
+    ~Inflater() { inflateEnd(&zs); }
+    Inflater(const Inflater&) = delete;
+    Inflater& operator=(const Inflater&) = delete;
+
+    z_stream& reset() {
+        inflateReset(&zs);
+        return zs;
+    }
+    z_stream& stream() { return zs; }
+
+private:
+    z_stream zs = {};
+};
+
+// Inflates one zlib stream that must produce exactly out.size() bytes
+bool inflateExact(const unsigned char* data, size_t avail, string& out) {
+    thread_local Inflater inflater;
+    z_stream& zs = inflater.reset();
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = avail;
+    zs.next_out = (Bytef*)out.data();
+    zs.avail_out = out.size();
+    int ret = inflate(&zs, Z_FINISH);
+    return ret == Z_STREAM_END && zs.total_out == out.size();
+}
+
+uint32_t readBE32(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// A packfile with its version 2 .idx, used to read objects that are not loose
+class PackFile {
+public:
+    explicit PackFile(const fs::path& packPath) : path(packPath), pack(packPath), idx(fs::path(packPath).replace_extension(".idx")) {
+        const unsigned char* d = idx.data();
+        if (idx.size() < 8 + 256 * 4 || memcmp(d, "\377tOc", 4) != 0 || readBE32(d + 4) != 2) {
+            throw runtime_error("Unsupported pack index: " + path.string());
+        }
+        fanout = d + 8;
+        count = readBE32(fanout + 255 * 4);
+        shas = fanout + 256 * 4;
+        offsets32 = shas + count * 20 + count * 4; // Skip the CRC32 table
+        offsets64 = offsets32 + count * 4;
+        if (pack.size() < 12 || memcmp(pack.data(), "PACK", 4) != 0) throw runtime_error("Invalid pack: " + path.string());
+    }
+
+    // Pack offset of the object, or npos if this pack does not hold it
+    size_t find(const string& shaHex) const {
+        if (shaHex.size() != 40) return string::npos;
+        unsigned char raw[20];
+        for (int i = 0; i < 20; ++i) raw[i] = stoi(shaHex.substr(i * 2, 2), nullptr, 16);
+
+        size_t lo = raw[0] == 0 ? 0 : readBE32(fanout + (raw[0] - 1) * 4);
+        size_t hi = readBE32(fanout + raw[0] * 4);
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            int cmp = memcmp(shas + mid * 20, raw, 20);
+            if (cmp == 0) return offsetAt(mid);
+            if (cmp < 0) lo = mid + 1;
+            else hi = mid;
+        }
+        return string::npos;
+    }
+
+    // Reconstructs the object at `offset` as "type size\0data"
+    string readAt(size_t offset) const {
+        auto [type, data] = readPayload(offset);
+        return typeToString(type) + " " + to_string(data.size()) + '\0' + data;
+    }
+
+    size_t objectCount() const { return count; }
+
+    // Raw delta stored at `offset` and the contents of its base; false if the
+    // entry is not a delta
+    bool readDelta(size_t offset, string& base, string& delta) const {
+        const unsigned char* d = pack.data();
+        size_t pos = offset;
+        unsigned char b = d[pos++];
+        int type = (b >> 4) & 7;
+        size_t size = b & 15;
+        int shift = 4;
+        while (b & 0x80) {
+            b = d[pos++];
+            size |= (size_t)(b & 0x7F) << shift;
+            shift += 7;
+        }
+        if (type == 6) {
+            b = d[pos++];
+            size_t neg = b & 0x7F;
+            while (b & 0x80) { b = d[pos++]; neg = ((neg + 1) << 7) | (b & 0x7F); }
+            base = readPayload(offset - neg).second;
+        } else if (type == 7) {
+            string full = readObject(shaToHex(string_view((const char*)d + pos, 20)));
+            base.assign(string_view(full).substr(full.find('\0') + 1));
+            pos += 20;
+        } else {
+            return false;
+        }
+        delta = inflateAt(pos, size);
+        return true;
+    }
+
+    // Pack offset of the i-th object in index (SHA) order
+    size_t offsetAt(size_t i) const {
+        uint32_t off = readBE32(offsets32 + i * 4);
+        if (!(off & 0x80000000)) return off;
+        const unsigned char* p = offsets64 + (off & 0x7FFFFFFF) * 8;
+        return (size_t)readBE32(p) << 32 | readBE32(p + 4);
+    }
+
+    const fs::path path;
+
+private:
+    pair<int, string> readPayload(size_t offset) const {
+        const unsigned char* d = pack.data();
+        size_t pos = offset;
+        unsigned char b = d[pos++];
+        int type = (b >> 4) & 7;
+        size_t size = b & 15;
+        int shift = 4;
+        while (b & 0x80) {
+            b = d[pos++];
+            size |= (size_t)(b & 0x7F) << shift;
+            shift += 7;
+        }
+
+        if (type == 6) { // OFS_DELTA
+            b = d[pos++];
+            size_t neg = b & 0x7F;
+            while (b & 0x80) { b = d[pos++]; neg = ((neg + 1) << 7) | (b & 0x7F); }
+            auto base = readPayload(offset - neg);
+            return {base.first, applyDelta(base.second, inflateAt(pos, size))};
+        }
+        if (type == 7) { // REF_DELTA: the base may live anywhere in the object store
+            string baseFull = readObject(shaToHex(string_view((const char*)d + pos, 20)));
+            pos += 20;
+            int baseType = typeFromString(baseFull.substr(0, baseFull.find(' ')));
+            return {baseType, applyDelta(string_view(baseFull).substr(baseFull.find('\0') + 1), inflateAt(pos, size))};
+        }
+        return {type, inflateAt(pos, size)};
+    }
+
+    string inflateAt(size_t pos, size_t size) const {
+        string out(size, '\0');
+        if (!inflateExact(pack.data() + pos, pack.size() - pos, out)) throw runtime_error("Corrupt object in " + path.string());
+        return out;
+    }
+
+    MappedFile pack, idx;
+    const unsigned char *fanout, *shas, *offsets32, *offsets64;
+    size_t count;
+};
+
+// Pack holding `sha` and the object's offset in it, or {nullptr, npos}.
+// Packs of every object directory are loaded lazily. A miss rescans only the
+// pack directories modified since their last scan, so packs written since
+// then are picked up without listing every directory on every miss.
+pair<const PackFile*, size_t> findPackedObject(const string& sha) {
+    static map<string, unique_ptr<PackFile>> packs;     // Keyed by pack path
+    static map<fs::path, fs::file_time_type> scannedAt; // Pack directory -> mtime when listed
+    // Delta resolution threads read thin-pack bases through here. Packs are
+    // never dropped, so a returned PackFile stays valid after unlocking.
+    static mutex packsMutex;
+    lock_guard<mutex> lock(packsMutex);
+
+    auto search = [&]() -> pair<const PackFile*, size_t> {
+        for (const auto& [packPath, pack] : packs) {
+            size_t offset = pack->find(sha);
+            if (offset != string::npos) return {pack.get(), offset};
+        }
+        return {nullptr, string::npos};
+    };
+    if (auto hit = search(); hit.first) return hit;
+
+    bool added = false;
+    for (const auto& dir : objectDirectories()) {
+        fs::path packDir = dir / "pack";
+        error_code ec;
+        auto mtime = fs::last_write_time(packDir, ec);
+        if (ec) continue; // No pack directory
+        auto scanned = scannedAt.find(packDir);
+        if (scanned != scannedAt.end() && scanned->second == mtime) continue;
+        scannedAt[packDir] = mtime;
+        for (const auto& entry : fs::directory_iterator(packDir)) {
+            fs::path p = entry.path();
+            if (p.extension() != ".pack" || packs.count(p.string())) continue;
+            if (!fs::exists(fs::path(p).replace_extension(".idx"))) continue; // Still being written
+            packs[p.string()] = make_unique<PackFile>(p);
+            added = true;
+        }
+    }
+    return added ? search() : pair<const PackFile*, size_t>{nullptr, string::npos};
+}
+
+bool readPackedObject(const string& sha, string& out) {
+    auto [pack, offset] = findPackedObject(sha);
+    if (!pack) return false;
+    out = pack->readAt(offset);
+    return true;
+}
+
+bool hasPackedObject(const string& sha) {
+    return findPackedObject(sha).first != nullptr;
+}
+
+struct PackObject {
+    int type;
+    string data, sha, baseSha;
+    size_t offset, baseOffset = 0;
+    size_t dataOffset = 0, size = 0; // Where the zlib stream starts and its inflated size
+    uint32_t crc = 0;                // CRC32 of the entry's raw bytes, as stored in an .idx v2
+    uint32_t index = 0;              // Position of the entry in the pack
+};
+
+// Byte-bounded LRU cache of reconstructed objects, keyed by pack offset.
+// Entries are shared so an evicted base stays alive while a delta uses it.
+class DeltaBaseCache {
+public:
+    explicit DeltaBaseCache(size_t budget) : budget(budget) {}
+
+    shared_ptr<const string> get(size_t offset) {
+        auto it = index.find(offset);
+        if (it == index.end()) return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+
+    void put(size_t offset, shared_ptr<const string> data) {
+        if (data->size() > budget || index.count(offset)) return;
+        used += data->size();
+        lru.emplace_front(offset, std::move(data));
+        index[offset] = lru.begin();
+        while (used > budget) {
+            used -= lru.back().second->size();
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+private:
+    size_t budget, used = 0;
+    list<pair<size_t, shared_ptr<const string>>> lru;
+    unordered_map<size_t, list<pair<size_t, shared_ptr<const string>>>::iterator> index;
+};
+
+// core.deltaBaseCacheLimit, as in git
+const size_t defaultDeltaBaseCacheLimit = 96 << 20;
+
+// Incremental SHA-1 over data that is produced or consumed in pieces
+class Sha1Hasher {
+public:
+    Sha1Hasher() : ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free) {
+        if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha1(), nullptr) != 1) throw runtime_error("SHA-1 init failed");
+    }
+    void update(const void* data, size_t len) { EVP_DigestUpdate(ctx.get(), data, len); }
+    // Raw 20-byte digest
+    string finish() {
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(ctx.get(), hash, &len);
+        return string((char*)hash, len);
+    }
+
+private:
+    unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx;
+};
+
+// Hashes a fully reconstructed object and, if `write`, stores it as a loose object
+void storePackObject(PackObject& obj, bool write = true) {
+    string header = typeToString(obj.type) + " " + to_string(obj.data.size()) + '\0';
+    Sha1Hasher hasher;
+    hasher.update(header.data(), header.size());
+    hasher.update(obj.data.data(), obj.data.size());
+    obj.sha = shaToHex(hasher.finish());
+    if (write) writeObjectWithSha(header, obj.data, obj.sha);
+}
+
+// Incremental packfile parser. Bytes are fed in as they arrive from the network
+// and spooled to objects/pack/tmp_pack_*; each entry is inflated as soon as its
+// compressed data is available, and base objects are hashed and written right
+// away. Only offsets are kept: deltas are filed into a base->children graph and
+// resolved by finish(), one worker thread per core, each taking whole delta
+// trees (a base and all of its descendants). Bases are re-inflated from the
+// spooled pack on demand through a per-thread DeltaBaseCache, so memory stays
+// bounded by core.deltaBaseCacheLimit rather than by the repository size.
+class PackReceiver {
+public:
+    // `threads` of 0 uses one worker per hardware thread
+    explicit PackReceiver(unsigned threads = 0) : threads(threads ? threads : max(1u, thread::hardware_concurrency())) {}
+    PackReceiver(const PackReceiver&) = delete;
+    PackReceiver& operator=(const PackReceiver&) = delete;
+    ~PackReceiver() {
+        if (!spoolPath.empty() && ownsSpool) {
+            spool.close();
+            error_code ec;
+            fs::remove(spoolPath, ec);
+        }
+    }
+
+    void feed(const char* data, size_t len) {
+        if (spoolPath.empty()) {
+            static atomic<unsigned> serial{0};
+            fs::create_directories(gitDir / "objects/pack");
+            spoolPath = gitDir / "objects/pack" / ("tmp_pack_" + to_string(getpid()) + "_" + to_string(serial++));
+            spool.open(spoolPath, ios::binary | ios::trunc);
+        }
+        if (ownsSpool) {
+            spool.write(data, len);
+            if (!spool) throw runtime_error("Failed to write " + spoolPath.string());
+        }
+
+        // Only a header or trailer split across chunks is copied: top up the
+        // carried bytes with enough of this chunk to complete it, then parse
+        // the rest of the chunk in place
+        size_t pos = 0;
+        while (!carry.empty() && pos < len) {
+            size_t take = min(len - pos, maxHeaderSize);
+            carry.append(data + pos, take);
+            pos += take;
+            carry.erase(0, parse(carry.data(), carry.size()));
+        }
+        if (!carry.empty()) return;
+        size_t used = parse(data + pos, len - pos);
+        carry.assign(data + pos + used, len - pos - used);
+    }
+
+    // Called once the stream has ended; resolves every delta tree in parallel
+    void finish() {
+        if (state == State::Trailer) throw runtime_error("Pack trailer is truncated (all " + to_string(numObjs) + " objects were received)");
+        if (state != State::Done) throw runtime_error("Pack stream ended early (" + to_string(parsed) + " of " + to_string(numObjs) + " objects)");
+        spool.close();
+        if (!deltaCount) return;
+
+        MappedFile spoolFile(spoolPath);
+        if (spoolFile.size() < spoolOffset) throw runtime_error("Spool " + spoolPath.string() + " is shorter than the pack");
+        string_view pack((const char*)spoolFile.data() + spoolOffset, spoolFile.size() - spoolOffset);
+        string limit = configValue("core.deltabasecachelimit", "");
+        size_t cacheLimit = limit.empty() ? defaultDeltaBaseCacheLimit : parseByteSize(limit);
+        claimed = make_unique<atomic<bool>[]>(numObjs);
+        size_t resolved = resolveTrees(bases, pack, cacheLimit);
+
+        // A thin pack leaves REF_DELTAs against objects the receiver already
+        // has. Their children were never reached above, so they are unclaimed.
+        // An index must only describe the pack itself, so indexFile() skips this.
+        if (resolved < deltaCount && storeObjects) {
+            vector<PackObject> localBases;
+            for (const auto& [sha, children] : waitingOnSha) {
+                if (claimed[children.front().index] || !objectExists(sha)) continue;
+                string full = readObject(sha);
+                PackObject root;
+                root.type = typeFromString(full.substr(0, full.find(' ')));
+                root.sha = sha;
+                root.offset = pack.size() + localBases.size(); // Past the end: matches no OFS_DELTA
+                localBases.push_back(std::move(root));
+            }
+            cerr << "[DEBUG] Completing thin pack from " << localBases.size() << " local base(s)" << endl;
+            resolved += resolveTrees(localBases, pack, cacheLimit);
+        }
+
+        if (resolved < deltaCount) {
+            throw runtime_error(to_string(deltaCount - resolved) + " delta(s) have no base in the pack" +
+                                (storeObjects ? " or the object store" : " (a thin pack cannot be indexed)"));
+        }
+    }
+
+    uint32_t objectCount() const { return numObjs; }
+
+    // Uses `file` as the spool instead of writing a copy of the fed bytes.
+    // The caller must have written every fed byte to it by finish(); the pack
+    // starts `offset` bytes into it (after a bundle header, for instance).
+    // Must be called before the first feed().
+    void useSpool(const fs::path& file, size_t offset) {
+        spoolPath = file;
+        spoolOffset = offset;
+        ownsSpool = false;
+    }
+
+    // Parses and resolves an existing pack file in place, for writeIndex().
+    // Nothing is spooled and no objects are stored; they are only hashed.
+    void indexFile(const fs::path& packPath) {
+        useSpool(packPath, 0);
+        storeObjects = false;
+        MappedFile pack(packPath);
+        feed((const char*)pack.data(), pack.size());
+        finish();
+    }
+
+    // Writes a version 2 .idx for the parsed pack: a 256-entry fanout table,
+    // the sorted SHAs, each entry's CRC32, and 31-bit offsets with a 64-bit
+    // overflow table, followed by the pack and index checksums
+    void writeIndex(const fs::path& idxPath) const {
+        vector<const PackObject*> entries(bases.size() + deltaCount);
+        size_t n = 0;
+        for (const auto& obj : bases) entries[n++] = &obj;
+        for (const auto& [offset, children] : waitingOnOffset) {
+            for (const auto& obj : children) entries[n++] = &obj;
+        }
+        for (const auto& [sha, children] : waitingOnSha) {
+            for (const auto& obj : children) entries[n++] = &obj;
+        }
+        sort(entries.begin(), entries.end(), [](const PackObject* a, const PackObject* b) { return a->sha < b->sha; });
+
+        Sha1Hasher hasher;
+        string out;
+        auto put32 = [&](uint32_t v) {
+            out += string{(char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v};
+        };
+        out += "\377tOc";
+        put32(2);
+        size_t below = 0;
+        for (int byte = 0; byte < 256; ++byte) {
+            while (below < entries.size() && stoi(entries[below]->sha.substr(0, 2), nullptr, 16) <= byte) ++below;
+            put32(below);
+        }
+        for (const auto* obj : entries) out += hexToSha(obj->sha);
+        for (const auto* obj : entries) put32(obj->crc);
+        vector<size_t> largeOffsets;
+        for (const auto* obj : entries) {
+            if (obj->offset < 0x80000000) {
+                put32(obj->offset);
+            } else {
+                put32(0x80000000 | largeOffsets.size());
+                largeOffsets.push_back(obj->offset);
+            }
+        }
+        for (size_t offset : largeOffsets) {
+            put32(offset >> 32);
+            put32(offset & 0xFFFFFFFF);
+        }
+        out += checksum;
+        hasher.update(out.data(), out.size());
+        out += hasher.finish();
+
+        fs::path tmpPath = idxPath.string() + ".lock";
+        ofstream file(tmpPath, ios::binary | ios::trunc);
+        file.write(out.data(), out.size());
+        file.close();
+        if (!file) throw runtime_error("Failed to write " + tmpPath.string());
+        fs::rename(tmpPath, idxPath);
+    }
+
+    // Raw trailer SHA-1 of the parsed pack
+    const string& packChecksum() const { return checksum; }
+
+private:
+    enum class State { Header, EntryHeader, Inflate, Trailer, Done };
+
+    // Longest pack, entry or trailer header (a 64-bit size varint plus a
+    // REF_DELTA base SHA stays well below this)
+    static constexpr size_t maxHeaderSize = 64;
+
+    // Advances the state machine over `data` without copying it. Returns the
+    // number of bytes consumed; the rest is an incomplete header.
+    size_t parse(const char* data, size_t len) {
+        size_t pos = 0;
+        while (state != State::Done) {
+            if (state == State::Header) {
+                if (len - pos < 12) break;
+                if (memcmp(data + pos, "PACK", 4) != 0) throw runtime_error("Invalid pack signature");
+                const unsigned char* h = (const unsigned char*)data + pos;
+                numObjs = (uint32_t)h[8] << 24 | (uint32_t)h[9] << 16 | (uint32_t)h[10] << 8 | h[11];
+                cerr << "[DEBUG] Number of objects: " << numObjs << endl;
+                pos += 12;
+                state = numObjs ? State::EntryHeader : State::Trailer;
+            } else if (state == State::EntryHeader) {
+                size_t used = parseEntryHeader(data, len, pos);
+                if (used == 0) break; // Header not complete yet
+                current.crc = crc32_z(0, (const Bytef*)data + pos, used);
+                pos += used;
+                inflater.reset();
+                state = State::Inflate;
+            } else if (state == State::Inflate) {
+                if (pos == len) break;
+                // The entry header gives the inflated size, so output goes
+                // straight into a buffer of that size: the object itself for
+                // bases, a reused scratch buffer for deltas (which are only
+                // applied later, from the spool).
+                char* out = current.type < 6 ? current.data.data() : scratch.data();
+                z_stream& zs = inflater.stream();
+                zs.next_in = (Bytef*)(data + pos);
+                zs.avail_in = len - pos;
+                zs.next_out = (Bytef*)(out + zs.total_out);
+                zs.avail_out = current.size - zs.total_out;
+                int ret = inflate(&zs, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    throw runtime_error("Corrupt zlib data in pack entry at offset " + to_string(current.offset));
+                }
+                if (ret != Z_STREAM_END && zs.avail_out == 0 && zs.avail_in > 0) {
+                    throw runtime_error("Pack entry at offset " + to_string(current.offset) + " inflates past its size");
+                }
+                current.crc = crc32_z(current.crc, (const Bytef*)data + pos, len - zs.avail_in - pos);
+                pos = len - zs.avail_in;
+                if (ret != Z_STREAM_END) break; // Need more input
+                if (zs.total_out != current.size) {
+                    throw runtime_error("Pack entry at offset " + to_string(current.offset) + " inflates to the wrong size");
+                }
+                onEntry(std::move(current));
+                current = PackObject{};
+                state = (++parsed == numObjs) ? State::Trailer : State::EntryHeader;
+            } else if (state == State::Trailer) {
+                if (len - pos < 20) break;
+                packHash.update(data, pos);
+                checksum = packHash.finish();
+                if (memcmp(data + pos, checksum.data(), 20) != 0) {
+                    throw runtime_error("Pack checksum mismatch: expected " + shaToHex(string_view(data + pos, 20)) +
+                                        ", computed " + shaToHex(checksum));
+                }
+                pos += 20;
+                state = State::Done;
+            }
+        }
+        if (state != State::Done) packHash.update(data, pos); // Everything consumed precedes the trailer
+        bufOffset += pos;
+        return pos;
+    }
+
+    // Returns the number of header bytes consumed, or 0 if more input is needed
+    size_t parseEntryHeader(const char* data, size_t len, size_t start) {
+        size_t pos = start;
+        auto next = [&](unsigned char& b) {
+            if (pos >= len) return false;
+            b = data[pos++];
+            return true;
+        };
+
+        PackObject obj;
+        obj.offset = bufOffset + start;
+        obj.index = parsed;
+        unsigned char b;
+        if (!next(b)) return 0;
+        obj.type = (b >> 4) & 7;
+        size_t size = b & 15;
+        int shift = 4;
+        while (b & 0x80) {
+            if (!next(b)) return 0;
+            size |= (size_t)(b & 0x7F) << shift;
+            shift += 7;
+        }
+
+        if (obj.type == 6) { // OFS_DELTA
+            if (!next(b)) return 0;
+            size_t neg = b & 0x7F;
+            while (b & 0x80) {
+                if (!next(b)) return 0;
+                neg = ((neg + 1) << 7) | (b & 0x7F);
+            }
+            obj.baseOffset = obj.offset - neg;
+        } else if (obj.type == 7) { // REF_DELTA
+            if (len - pos < 20) return 0;
+            obj.baseSha = shaToHex(string_view(data + pos, 20));
+            pos += 20;
+        }
+
+        obj.dataOffset = bufOffset + pos;
+        obj.size = size;
+        if (obj.type < 6) obj.data.resize(size);
+        else if (scratch.size() < size) scratch.resize(size);
+        current = std::move(obj);
+        return pos - start;
+    }
+
+    // Base objects are stored at once; deltas wait in the base->children
+    // graph, keyed by offset (OFS_DELTA) or by SHA (REF_DELTA). No inflated
+    // data is kept.
+    void onEntry(PackObject&& obj) {
+        if (obj.type < 6) storePackObject(obj, storeObjects);
+        else ++deltaCount;
+        obj.data = string();
+        if (obj.type < 6) bases.push_back(std::move(obj));
+        else if (obj.type == 6) waitingOnOffset[obj.baseOffset].push_back(std::move(obj));
+        else waitingOnSha[obj.baseSha].push_back(std::move(obj));
+    }
+
+    // Resolves the delta trees below `roots` on the worker threads and returns
+    // the number of deltas stored
+    size_t resolveTrees(const vector<PackObject>& roots, string_view pack, size_t cacheLimit) {
+        if (roots.empty()) return 0;
+        atomic<size_t> next{0}, resolved{0};
+        exception_ptr error;
+        mutex errorMutex;
+        unsigned workers = min<size_t>(threads, roots.size());
+        auto worker = [&] {
+            try {
+                DeltaBaseCache cache(cacheLimit / workers);
+                for (size_t i; (i = next++) < roots.size();) resolved += resolveDescendants(roots[i], pack, cache);
+            } catch (...) {
+                lock_guard<mutex> lock(errorMutex);
+                if (!error) error = current_exception();
+                next = roots.size(); // Stop the other workers early
+            }
+        };
+        cerr << "[DEBUG] Resolving deltas below " << roots.size() << " base(s) with " << workers << " thread(s)..." << endl;
+        vector<thread> pool;
+        for (unsigned i = 1; i < workers; ++i) pool.emplace_back(worker);
+        worker();
+        for (auto& t : pool) t.join();
+        if (error) rethrow_exception(error);
+        return resolved;
+    }
+
+    // Applies and stores every delta below `root`, depth first. The stack
+    // holds only entries; object data comes from `cache` or is rebuilt from
+    // the pack along the chain, or from the object store for a base outside
+    // the pack. The graph's shape is read-only here. A delta can be reachable
+    // from more than one root (a local base whose SHA a pack delta also
+    // produces, say), so each one is claimed first and only its claimer
+    // resolves it and records its SHA.
+    size_t resolveDescendants(const PackObject& root, string_view pack, DeltaBaseCache& cache) {
+        struct Frame {
+            const PackObject* entry;
+            vector<PackObject*> children;
+            size_t next = 0;
+        };
+        auto childrenOf = [&](size_t offset, const string& sha) {
+            vector<PackObject*> out;
+            if (auto it = waitingOnOffset.find(offset); it != waitingOnOffset.end()) {
+                for (auto& child : it->second) out.push_back(&child);
+            }
+            if (auto it = waitingOnSha.find(sha); it != waitingOnSha.end()) {
+                for (auto& child : it->second) out.push_back(&child);
+            }
+            return out;
+        };
+        auto inflateEntry = [&](const PackObject& entry) {
+            if (entry.offset >= pack.size()) { // Thin pack base from the object store
+                string full = readObject(entry.sha);
+                return full.substr(full.find('\0') + 1);
+            }
+            string out(entry.size, '\0');
+            if (!inflateExact((const unsigned char*)pack.data() + entry.dataOffset, pack.size() - entry.dataOffset, out)) {
+                throw runtime_error("Corrupt zlib data in pack entry at offset " + to_string(entry.offset));
+            }
+            return out;
+        };
+
+        vector<Frame> stack;
+        // Contents of the object at stack[i], rebuilt from its ancestors on a cache miss
+        function<shared_ptr<const string>(size_t)> dataOf = [&](size_t i) {
+            if (auto hit = cache.get(stack[i].entry->offset)) return hit;
+            auto data = make_shared<const string>(i == 0 ? inflateEntry(*stack[i].entry)
+                                                         : applyDelta(*dataOf(i - 1), inflateEntry(*stack[i].entry)));
+            cache.put(stack[i].entry->offset, data);
+            return data;
+        };
+
+        size_t count = 0;
+        auto children = childrenOf(root.offset, root.sha);
+        if (!children.empty()) stack.push_back({&root, std::move(children)});
+        while (!stack.empty()) {
+            Frame& top = stack.back();
+            if (top.next == top.children.size()) {
+                stack.pop_back();
+                continue;
+            }
+            PackObject* delta = top.children[top.next++];
+            if (claimed[delta->index].exchange(true)) continue;
+            PackObject obj;
+            obj.offset = delta->offset;
+            obj.type = root.type;
+            obj.data = applyDelta(*dataOf(stack.size() - 1), inflateEntry(*delta));
+            storePackObject(obj, storeObjects);
+            delta->sha = obj.sha;
+            ++count;
+            auto grandchildren = childrenOf(obj.offset, obj.sha);
+            if (!grandchildren.empty()) {
+                cache.put(obj.offset, make_shared<const string>(std::move(obj.data)));
+                stack.push_back({delta, std::move(grandchildren)});
+            }
+        }
+        return count;
+    }
+
+    State state = State::Header;
+    string carry;          // Start of a header split across feed() calls
+    size_t bufOffset = 0;  // Pack offset of the next byte parse() sees
+    uint32_t numObjs = 0, parsed = 0;
+    Inflater inflater;     // Reset for every entry
+    Sha1Hasher packHash;   // Every byte before the trailer
+    string checksum;       // Raw trailer SHA-1, once verified
+    string scratch;        // Inflated delta data, discarded once the entry ends
+    PackObject current;
+
+    unsigned threads;
+    fs::path spoolPath;
+    ofstream spool;
+    size_t spoolOffset = 0;   // Where the pack starts in the spool
+    bool ownsSpool = true;    // False when the spool is the caller's file (useSpool)
+    bool storeObjects = true; // Write resolved objects to the object store
+    vector<PackObject> bases;                        // Non-delta objects, roots of the delta trees
+    map<size_t, vector<PackObject>> waitingOnOffset; // OFS_DELTA children by base offset
+    map<string, vector<PackObject>> waitingOnSha;    // REF_DELTA children by base SHA
+    unique_ptr<atomic<bool>[]> claimed;              // Per entry index: resolved by some worker
+    size_t deltaCount = 0;
+};
+
+// Checkout works relative to an open directory descriptor so the kernel only
+// resolves a single path component per entry instead of the full path.
+void checkoutRecursive(const string& treeSha, int dirFd) {
+    string content = readObject(treeSha);
+    size_t nullPos = content.find('\0');
+    string body = content.substr(nullPos + 1);
+
+    size_t i = 0;
+    while (i < body.size()) {
+        size_t spacePos = body.find(' ', i);
+        size_t nullPos = body.find('\0', spacePos);
+        string mode = body.substr(i, spacePos - i);
+        string name = body.substr(spacePos + 1, nullPos - (spacePos + 1));
+        string shaRaw = body.substr(nullPos + 1, 20);
+        i = nullPos + 1 + 20;
+
+        string entrySha = shaToHex(shaRaw);
+
+        if (mode == "40000" || mode == "160000") {
+            // Each directory is created exactly once, right before we descend into it
+            if (mkdirat(dirFd, name.c_str(), 0777) != 0 && errno != EEXIST) {
+                throw runtime_error("Failed to create directory " + name + ": " + strerror(errno));
+            }
+            if (mode == "160000") continue; // Submodule: leave an empty directory
+
+            FdGuard sub(openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if (sub.fd < 0) throw runtime_error("Failed to open directory " + name + ": " + strerror(errno));
+            checkoutRecursive(entrySha, sub.fd);
+        } else {
+            string blobFull = readObject(entrySha);
+            size_t dataStart = blobFull.find('\0') + 1;
+
+            if (mode == "120000") {
+                string target = blobFull.substr(dataStart);
+                unlinkat(dirFd, name.c_str(), 0);
+                if (symlinkat(target.c_str(), dirFd, name.c_str()) != 0) {
+                    throw runtime_error("Failed to create symlink " + name + ": " + strerror(errno));
+                }
+                continue;
+            }
+
+            mode_t perm = (mode == "100755") ? 0777 : 0666;
+            FdGuard out(openat(dirFd, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, perm));
+            if (out.fd < 0) throw runtime_error("Failed to create file " + name + ": " + strerror(errno));
+            writeAll(out.fd, blobFull.data() + dataStart, blobFull.size() - dataStart);
+        }
+    }
+}
+
+void checkoutRecursive(const string& treeSha, const fs::path& dir) {
+    FdGuard root(open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (root.fd < 0) throw runtime_error("Failed to open directory " + dir.string() + ": " + strerror(errno));
+    checkoutRecursive(treeSha, root.fd);
+}
+
+// //
+
+// --- Config ---
+
+// Parses .git/config into "section.subsection.key" -> value
+map<string, string> readConfig() {
+    map<string, string> config;
+    ifstream file(gitDir / "config");
+    string line, section;
+    while (getline(file, line)) {
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#' || line[start] == ';') continue;
+        line = line.substr(start);
+        if (line[0] == '[') {
+            // [remote "origin"] -> remote.origin
+            string header = line.substr(1, line.find(']') - 1);
+            size_t quote = header.find('"');
+            if (quote != string::npos) {
+                string name = header.substr(0, quote);
+                name.erase(name.find_last_not_of(" \t") + 1);
+                section = name + "." + header.substr(quote + 1, header.rfind('"') - quote - 1);
+            } else {
+                section = header;
+            }
+            continue;
+        }
+        size_t eq = line.find('=');
+        string key = line.substr(0, eq), value = eq == string::npos ? "true" : line.substr(eq + 1);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+        config[section + "." + key] = value;
+    }
+    return config;
+}
+
+string configValue(const string& key, const string& fallback = "") {
+    auto config = readConfig();
+    auto it = config.find(key);
+    return it == config.end() ? fallback : it->second;
+}
+
+// --- History ---
+
+struct CommitInfo {
+    string tree;
+    vector<string> parents;
+    long long time = 0; // Committer timestamp
+};
+
+CommitInfo parseCommit(const string& sha) {
+    string obj = readObject(sha);
+    size_t nullPos = obj.find('\0');
+    if (obj.compare(0, 7, "commit ") != 0) throw runtime_error("Not a commit: " + sha);
+
+    CommitInfo info;
+    stringstream ss(obj.substr(nullPos + 1));
+    string line;
+    while (getline(ss, line) && !line.empty()) {
+        if (line.starts_with("tree ")) info.tree = line.substr(5, 40);
+        else if (line.starts_with("parent ")) info.parents.push_back(line.substr(7, 40));
+        else if (line.starts_with("committer ")) {
+            // "committer Name <email> <timestamp> <tz>"
+            size_t gt = line.rfind('>');
+            if (gt != string::npos) info.time = atoll(line.c_str() + gt + 1);
+        }
+    }
+    return info;
+}
+
+// The commit `sha` names, following annotated tags; empty if it names any
+// other kind of object or is not in the object store
+string peelToCommit(string sha) {
+    while (objectExists(sha)) {
+        string obj = readObject(sha);
+        if (obj.starts_with("commit ")) return sha;
+        if (!obj.starts_with("tag ")) break;
+        sha = obj.substr(obj.find('\0') + 8, 40); // "object <sha>"
+    }
+    return "";
+}
+
+// Commits listed in .git/shallow were fetched without their parents
+set<string> readShallow() {
+    set<string> shallow;
+    ifstream file(gitDir / "shallow");
+    string line;
+    while (getline(file, line)) {
+        if (line.size() >= 40) shallow.insert(line.substr(0, 40));
+    }
+    return shallow;
+}
+
+void writeShallow(const set<string>& shallow) {
+    if (shallow.empty()) {
+        fs::remove(gitDir / "shallow");
+        return;
+    }
+    ofstream file(gitDir / "shallow");
+    for (const auto& sha : shallow) file << sha << "\n";
+}
+
+// Incremental newest-first commit walk. Commits marked uninteresting are
+// skipped along with their ancestors, and parents of shallow commits are
+// never followed since they are not present locally.
+class RevWalk {
+public:
+    RevWalk() : shallow(readShallow()) {}
+
+    void push(const string& sha) {
+        if (!seen.insert(sha).second) return;
+        CommitInfo info = parseCommit(sha);
+        queue.push({info.time, sha});
+        pending[sha] = std::move(info);
+    }
+
+    bool next(string& sha, CommitInfo* infoOut = nullptr) {
+        while (!queue.empty()) {
+            sha = queue.top().second;
+            queue.pop();
+            CommitInfo info = std::move(pending[sha]);
+            pending.erase(sha);
+            bool skip = uninteresting.count(sha);
+            if (!shallow.count(sha)) {
+                for (const auto& parent : info.parents) {
+                    if (skip) uninteresting.insert(parent);
+                    push(parent);
+                }
+            }
+            if (skip) continue;
+            emitted[sha] = info.parents;
+            if (infoOut) *infoOut = std::move(info);
+            return true;
+        }
+        return false;
+    }
+
+    // Hide `sha` and everything reachable from it (e.g. history the other side already has)
+    void markUninteresting(const string& sha) {
+        if (!uninteresting.insert(sha).second) return;
+        auto it = emitted.find(sha);
+        if (it == emitted.end() || shallow.count(sha)) return;
+        for (const auto& parent : it->second) markUninteresting(parent);
+    }
+
+private:
+    set<string> shallow, seen, uninteresting;
+    map<string, vector<string>> emitted; // Parents of commits already returned
+    map<string, CommitInfo> pending;     // Parsed commits waiting in the queue
+    priority_queue<pair<long long, string>> queue;
+};
+
+// Visits commits reachable from `starts`, newest first, stopping at shallow boundaries
+void walkCommits(const vector<string>& starts, const function<void(const string&, const CommitInfo&)>& visit) {
+    RevWalk walk;
+    for (const auto& sha : starts) walk.push(sha);
+    string sha;
+    CommitInfo info;
+    while (walk.next(sha, &info)) visit(sha, info);
+}
+
+// --- Remote Protocol ---
+
+struct RemoteRef {
+    string sha;
+    string name;
+    string symrefTarget; // Set for symbolic refs such as HEAD
+    string peeled;       // Object an annotated tag points to
+};
+
+struct FetchRequest {
+    vector<string> wants;
+    int depth = 0;          // 0 fetches full history
+    string filter;          // Object filter for partial clones, e.g. "blob:none"
+    vector<string> haves;   // Commits we already have, offered during negotiation
+    vector<string> shallow; // Our own shallow boundaries
+    bool done = true;       // false for an intermediate negotiation round
+};
+
+struct FetchResult {
+    vector<string> shallow;   // Commits that became history boundaries
+    vector<string> unshallow; // Former boundaries whose parents were sent
+    vector<string> common;    // Haves acknowledged by the server
+    bool ready = false;       // Server has enough to build the pack
+    bool gotPack = false;     // The response carried a pack
+};
+
+// Write a ref file such as "refs/heads/master" under .git
+void updateRef(const string& name, const string& sha) {
+    fs::path refPath = gitDir / name;
+    fs::create_directories(refPath.parent_path());
+    ofstream(refPath) << sha << "\n";
+}
+
+// All refs under .git/refs (loose files take precedence over packed-refs)
+map<string, string> readRefs() {
+    map<string, string> refs;
+    ifstream packed(gitDir / "packed-refs");
+    string line;
+    while (getline(packed, line)) {
+        if (line.size() < 42 || line[0] == '#' || line[0] == '^') continue;
+        refs[line.substr(41)] = line.substr(0, 40);
+    }
+    if (fs::exists(gitDir / "refs")) {
+        for (const auto& entry : fs::recursive_directory_iterator(gitDir / "refs")) {
+            if (!entry.is_regular_file()) continue;
+            ifstream file(entry.path());
+            string sha;
+            if (file >> sha && sha.size() == 40) refs[fs::relative(entry.path(), gitDir).generic_string()] = sha;
+        }
+    }
+    return refs;
+}
+
+// Resolve HEAD or a full ref name to a commit, following symbolic refs
+string resolveRef(const string& name) {
+    ifstream file(gitDir / name);
+    string content;
+    if (file && getline(file, content)) {
+        if (content.starts_with("ref: ")) return resolveRef(content.substr(5));
+        return content.substr(0, 40);
+    }
+    auto refs = readRefs();
+    return refs.count(name) ? refs[name] : "";
+}
+
+string stripNewline(string_view line) {
+    if (!line.empty() && line.back() == '\n') line.remove_suffix(1);
+    return string(line);
+}
+
+// Ref advertisement used by protocol v0 (upload-pack fallback and receive-pack)
+struct V0Advertisement {
+    vector<RemoteRef> refs;
+    map<string, string> caps;    // Capability words from the first line
+    map<string, string> symrefs; // "HEAD" -> "refs/heads/master"
+
+    // "<oid> <refname>[\0<capabilities>]"
+    void parseLine(const string& line) {
+        string refPart = line;
+        size_t nul = line.find('\0');
+        if (nul != string::npos) {
+            refPart = line.substr(0, nul);
+            stringstream ss(line.substr(nul + 1));
+            string cap;
+            while (ss >> cap) {
+                size_t eq = cap.find('=');
+                string key = cap.substr(0, eq), value = eq == string::npos ? "" : cap.substr(eq + 1);
+                if (key == "symref") {
+                    size_t colon = value.find(':');
+                    symrefs[value.substr(0, colon)] = value.substr(colon + 1);
+                } else {
+                    caps[key] = value;
+                }
+            }
+        }
+        if (refPart.size() < 42) return;
+
+        RemoteRef ref;
+        ref.sha = refPart.substr(0, 40);
+        ref.name = refPart.substr(41);
+        if (ref.name == "capabilities^{}") return; // Empty repository
+        if (ref.name.ends_with("^{}")) {
+            string tagName = ref.name.substr(0, ref.name.size() - 3);
+            if (!refs.empty() && refs.back().name == tagName) refs.back().peeled = ref.sha;
+            return;
+        }
+        if (symrefs.count(ref.name)) ref.symrefTarget = symrefs[ref.name];
+        refs.push_back(ref);
+    }
+};
+
+// How UploadPackClient reaches the remote. Smart HTTP is stateless: each
+// request is a separate POST read until EOF. A local upload-pack process keeps
+// one pipe pair open, so reads stop as soon as `complete` reports the end of
+// the response.
+class UploadPackTransport {
+public:
+    virtual ~UploadPackTransport() = default;
+    virtual void readAdvertisement(PktLineReader& reader, const function<bool()>& complete) = 0;
+    virtual void request(const string& body, bool v2, PktLineReader& reader, const function<bool()>& complete) = 0;
+};
+
+class HttpTransport : public UploadPackTransport {
+public:
+    explicit HttpTransport(string url) : url(std::move(url)) {}
+
+    void readAdvertisement(PktLineReader& reader, const function<bool()>&) override {
+        httpGet(url + "/info/refs?service=git-upload-pack", {"Git-Protocol: version=2"},
+                [&](const char* data, size_t len) { reader.feed(data, len); });
+    }
+
+    void request(const string& body, bool v2, PktLineReader& reader, const function<bool()>&) override {
+        vector<string> headers;
+        if (v2) headers.push_back("Git-Protocol: version=2");
+        ByteSink sink = [&](const char* data, size_t len) { reader.feed(data, len); };
+        // Have lists of a long negotiation are highly repetitive hex
+        if (body.size() > gzipRequestThreshold) {
+            headers.push_back("Content-Encoding: gzip");
+            httpPost(url + "/git-upload-pack", gzipBytes(body), "application/x-git-upload-pack-request", headers, sink);
+        } else {
+            httpPost(url + "/git-upload-pack", body, "application/x-git-upload-pack-request", headers, sink);
+        }
+    }
+
+private:
+    string url;
+};
+
+// Runs `git upload-pack <path>` (this binary) and talks protocol v2 over its stdin/stdout
+class ProcessTransport : public UploadPackTransport {
+public:
+    explicit ProcessTransport(const string& path) {
+        int toChild[2], fromChild[2];
+        if (pipe2(toChild, O_CLOEXEC) != 0 || pipe2(fromChild, O_CLOEXEC) != 0) {
+            throw runtime_error(string("pipe failed: ") + strerror(errno));
+        }
+        string self = fs::read_symlink("/proc/self/exe").string();
+        signal(SIGPIPE, SIG_IGN); // A dead child must surface as EPIPE, not kill us
+
+        pid = fork();
+        if (pid < 0) throw runtime_error(string("fork failed: ") + strerror(errno));
+        if (pid == 0) {
+            dup2(toChild[0], STDIN_FILENO);
+            dup2(fromChild[1], STDOUT_FILENO);
+            setenv("GIT_PROTOCOL", "version=2", 1);
+            execl(self.c_str(), self.c_str(), "upload-pack", path.c_str(), (char*)nullptr);
+            _exit(127);
+        }
+        close(toChild[0]);
+        close(fromChild[1]);
+        in = fromChild[0];
+        out = toChild[1];
+    }
+
+    ~ProcessTransport() override {
+        close(out); // EOF tells upload-pack to exit
+        close(in);
+        int status;
+        waitpid(pid, &status, 0);
+    }
+
+    void readAdvertisement(PktLineReader& reader, const function<bool()>& complete) override {
+        readResponse(reader, complete);
+    }
+
+    void request(const string& body, bool, PktLineReader& reader, const function<bool()>& complete) override {
+        writeAll(out, body.data(), body.size());
+        readResponse(reader, complete);
+    }
+
+private:
+    void readResponse(PktLineReader& reader, const function<bool()>& complete) {
+        char buf[65536];
+        while (!complete()) {
+            ssize_t n = read(in, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw runtime_error(string("read from upload-pack failed: ") + strerror(errno));
+            if (n == 0) throw runtime_error("upload-pack exited unexpectedly");
+            reader.feed(buf, n);
+        }
+    }
+
+    pid_t pid = -1;
+    int in = -1, out = -1;
+};
+
+bool isLocalUrl(const string& url) {
+    return url.starts_with("file://") || url.find("://") == string::npos;
+}
+
+unique_ptr<UploadPackTransport> openTransport(const string& url) {
+    if (isLocalUrl(url)) {
+        string path = url.starts_with("file://") ? url.substr(7) : url;
+        cerr << "[DEBUG] Spawning upload-pack for " << path << endl;
+        return make_unique<ProcessTransport>(path);
+    }
+    return make_unique<HttpTransport>(url);
+}
+
+// Client side of git-upload-pack over smart HTTP or a local process. Protocol
+// v2 is used when the server supports it, so ref discovery only transfers the
+// refs matching the requested prefixes; otherwise the v0 advertisement is
+// parsed and filtered.
+class UploadPackClient {
+public:
+    explicit UploadPackClient(const string& url) : transport(openTransport(url)) {}
+
+    // Capability discovery; must run before lsRefs() and fetch()
+    void connect() {
+        cerr << "[DEBUG] Discovering capabilities..." << endl;
+        bool sawService = false, started = false, complete = false;
+        PktLineReader reader([&](PktType type, string_view pkt) {
+            if (type == PktType::Flush && started) complete = true;
+            if (type != PktType::Data) return;
+            string line = stripNewline(pkt);
+            if (!started && !sawService && line.starts_with("# service=")) { sawService = true; return; }
+            if (line.starts_with("ERR ")) throw runtime_error("remote error: " + line.substr(4));
+            if (!started) {
+                started = true;
+                if (line == "version 2") { v2 = true; return; }
+            }
+            if (v2) {
+                size_t eq = line.find('=');
+                caps[line.substr(0, eq)] = eq == string::npos ? "" : line.substr(eq + 1);
+            } else {
+                v0.parseLine(line);
+            }
+        });
+        transport->readAdvertisement(reader, [&] { return complete; });
+        if (!v2) caps = v0.caps;
+        cerr << "[DEBUG] Server speaks protocol " << (v2 ? "v2" : "v0") << endl;
+    }
+
+    vector<RemoteRef> lsRefs(const vector<string>& prefixes) {
+        if (!v2) {
+            vector<RemoteRef> matched;
+            for (const auto& ref : v0.refs) {
+                for (const auto& prefix : prefixes) {
+                    if (ref.name.starts_with(prefix)) { matched.push_back(ref); break; }
+                }
+            }
+            return matched;
+        }
+
+        string req = createPktLine("command=ls-refs\n") + "0001" + createPktLine("peel\n") + createPktLine("symrefs\n");
+        for (const auto& prefix : prefixes) req += createPktLine("ref-prefix " + prefix + "\n");
+        req += "0000";
+
+        vector<RemoteRef> refs;
+        bool complete = false;
+        PktLineReader reader([&](PktType type, string_view pkt) {
+            if (type != PktType::Data) { complete = true; return; }
+            string line = stripNewline(pkt);
+            if (line.starts_with("ERR ")) throw runtime_error("remote error: " + line.substr(4));
+
+            // <oid> <refname> [symref-target:<target>] [peeled:<oid>]
+            RemoteRef ref;
+            stringstream ss(line);
+            string attr;
+            ss >> ref.sha >> ref.name;
+            while (ss >> attr) {
+                if (attr.starts_with("symref-target:")) ref.symrefTarget = attr.substr(14);
+                else if (attr.starts_with("peeled:")) ref.peeled = attr.substr(7);
+            }
+            refs.push_back(ref);
+        });
+        post(req, reader, complete);
+        return refs;
+    }
+
+    // Requests a pack for `req` and streams it into `pack`
+    FetchResult fetch(const FetchRequest& req, PackReceiver& pack) {
+        ByteSink packSink = [&](const char* data, size_t len) { pack.feed(data, len); };
+        FetchResult result;
+        bool done = false;
+
+        auto parseShallowLine = [&](const string& line) {
+            if (line.starts_with("shallow ")) result.shallow.push_back(line.substr(8, 40));
+            else if (line.starts_with("unshallow ")) result.unshallow.push_back(line.substr(10, 40));
+            else return false;
+            return true;
+        };
+        if ((req.depth > 0 || !req.shallow.empty()) && !supportsFetchFeature("shallow")) throw runtime_error("Server does not support shallow clones");
+        if (!req.filter.empty() && !supportsFetchFeature("filter")) throw runtime_error("Server does not support object filters");
+        string args;
+        for (const auto& sha : req.shallow) args += createPktLine("shallow " + sha + "\n");
+        if (req.depth > 0) args += createPktLine("deepen " + to_string(req.depth) + "\n");
+        if (!req.filter.empty()) args += createPktLine("filter " + req.filter + "\n");
+        string haves;
+        for (const auto& sha : req.haves) haves += createPktLine("have " + sha + "\n");
+
+        if (v2) {
+            // Response is a sequence of sections; the pack is always side-band framed.
+            // Without "done" the server only sends acknowledgments, unless it is ready.
+            string body = createPktLine("command=fetch\n") + "0001" + createPktLine("thin-pack\n") + createPktLine("ofs-delta\n");
+            for (const auto& want : req.wants) body += createPktLine("want " + want + "\n");
+            body += args + haves + (req.done ? createPktLine("done\n") : "") + "0000";
+
+            string section;
+            PktLineReader reader([&](PktType type, string_view pkt) {
+                if (type == PktType::Delim) { section.clear(); return; }
+                if (type != PktType::Data) { done = true; return; }
+                string line = stripNewline(pkt);
+                if (section.empty()) {
+                    section = line;
+                    if (section.starts_with("ERR ")) throw runtime_error("remote error: " + section.substr(4));
+                    if (section == "packfile") result.gotPack = true;
+                    return;
+                }
+                if (section == "packfile") demuxSideBand(pkt, packSink);
+                else if (section == "shallow-info") parseShallowLine(line);
+                else if (section == "acknowledgments") {
+                    if (line.starts_with("ACK ")) result.common.push_back(line.substr(4, 40));
+                    else if (line == "ready") result.ready = true;
+                }
+            });
+            post(body, reader, done);
+        } else {
+            // v0: ACK/NAK lines, then (after "done") the pack either in side-band
+            // frames or as raw bytes. multi_ack_detailed tags each ACK with its status.
+            bool sideBand = caps.count("side-band-64k");
+            string body;
+            for (size_t i = 0; i < req.wants.size(); ++i) {
+                string line = "want " + req.wants[i];
+                if (i == 0) {
+                    if (caps.count("multi_ack_detailed")) line += " multi_ack_detailed";
+                    if (sideBand) line += " side-band-64k";
+                    if (caps.count("thin-pack")) line += " thin-pack";
+                    line += " ofs-delta";
+                    if (!req.filter.empty()) line += " filter";
+                }
+                body += createPktLine(line + "\n");
+            }
+            body += args + "0000" + haves + (req.done ? createPktLine("done\n") : "0000");
+
+            bool negotiated = false;
+            PktLineReader reader([&](PktType type, string_view pkt) {
+                if (type != PktType::Data) {
+                    if (negotiated) done = true; // Flush terminates the side-band stream
+                    return;
+                }
+                if (!negotiated) {
+                    string line = stripNewline(pkt);
+                    if (line.starts_with("ERR ")) throw runtime_error("remote error: " + line.substr(4));
+                    if (parseShallowLine(line)) return;
+                    if (line.starts_with("ACK ") && line.size() > 45) {
+                        // "ACK <sha> common|ready|continue"
+                        result.common.push_back(line.substr(4, 40));
+                        if (line.ends_with(" ready")) result.ready = true;
+                        return;
+                    }
+                    if (line != "NAK" && !line.starts_with("ACK ")) return;
+                    if (line.starts_with("ACK ")) result.common.push_back(line.substr(4, 40));
+                    if (!req.done) return; // Intermediate round: no pack follows
+                    negotiated = true;
+                    result.gotPack = true;
+                    if (!sideBand) reader.switchToRaw(packSink);
+                    return;
+                }
+                demuxSideBand(pkt, packSink);
+            });
+            post(body, reader, done);
+            if (!req.done || (!sideBand && negotiated)) done = true;
+        }
+
+        if (!done) throw runtime_error("Truncated upload-pack response");
+        return result;
+    }
+
+    // "shallow" and "filter" are v0 capabilities, or features of the v2 fetch command
+    bool supportsFetchFeature(const string& feature) const {
+        if (!v2) return caps.count(feature);
+        auto it = caps.find("fetch");
+        return it != caps.end() && (" " + it->second + " ").find(" " + feature + " ") != string::npos;
+    }
+
+private:
+    void post(const string& body, PktLineReader& reader, const bool& complete) {
+        transport->request(body, v2, reader, [&] { return complete; });
+        if (reader.hasPartialPacket()) throw runtime_error("Truncated upload-pack response");
+    }
+
+    unique_ptr<UploadPackTransport> transport;
+    bool v2 = false;
+    map<string, string> caps; // v2 capability lines, or v0 capability words
+    V0Advertisement v0;
+};
+
+// Finds common history by offering local commits as "have" lines, newest first,
+// doubling the batch each round. Commits the server acknowledges hide their
+// ancestors from later rounds. Once the server is ready (or we run out of
+// haves, or too many go unacknowledged) the final request asks for the pack.
+FetchResult negotiateFetch(UploadPackClient& remote, FetchRequest req, const vector<string>& localTips, PackReceiver& pack) {
+    const size_t maxBatch = 1024, maxInVain = 256;
+    RevWalk walk;
+    for (const auto& tip : localTips) {
+        string commit = peelToCommit(tip); // Tags may point at tags, trees or blobs
+        if (!commit.empty()) walk.push(commit);
+    }
+
+    vector<string> common;
+    set<string> commonSet;
+    size_t batch = 16, inVain = 0;
+    bool ready = false;
+    for (int round = 1; ; ++round) {
+        // Stateless transports must repeat the common commits every round
+        req.haves = common;
+        size_t added = 0;
+        string sha;
+        while (!ready && added < batch && walk.next(sha)) {
+            req.haves.push_back(sha);
+            ++added;
+        }
+        req.done = ready || added < batch || inVain >= maxInVain;
+
+        cerr << "[DEBUG] Negotiation round " << round << ": " << req.haves.size() << " have(s)" << (req.done ? ", done" : "") << endl;
+        FetchResult result = remote.fetch(req, pack);
+        if (result.gotPack) return result;
+        if (req.done) throw runtime_error("Server did not send a pack");
+
+        bool progress = false;
+        for (const auto& c : result.common) {
+            if (!commonSet.insert(c).second) continue;
+            common.push_back(c);
+            walk.markUninteresting(c);
+            progress = true;
+        }
+        inVain = progress ? 0 : inVain + added;
+        ready = result.ready;
+        batch = min(batch * 2, maxBatch);
+    }
+}
+
+// Objects left out by a partial clone are requested from the promisor remote
+// in batches, without a filter so the blobs themselves are sent.
+bool fetchMissingObjects(const vector<string>& shas) {
+    auto config = readConfig();
+    string remoteName = config.count("extensions.partialclone") ? config["extensions.partialclone"] : "origin";
+    if (config["remote." + remoteName + ".promisor"] != "true") return false;
+    string url = config["remote." + remoteName + ".url"];
+    if (url.empty()) return false;
+
+    const size_t batchSize = 1000;
+    cerr << "[DEBUG] Fetching " << shas.size() << " missing object(s) from promisor remote" << endl;
+    UploadPackClient remote(url);
+    remote.connect();
+    for (size_t i = 0; i < shas.size(); i += batchSize) {
+        FetchRequest req;
+        req.wants.assign(shas.begin() + i, shas.begin() + min(shas.size(), i + batchSize));
+        PackReceiver pack;
+        remote.fetch(req, pack);
+        pack.finish();
+    }
+    return true;
+}
+
+// Collects every blob under a tree that is not present locally, so a partial
+// clone downloads them in a few batched requests instead of one per file
+void collectMissingBlobs(const string& treeSha, vector<string>& missing) {
+    for (const auto& entry : parseTree(treeSha)) {
+        string sha = shaToHex(entry.shaRaw);
+        if (entry.mode == "40000") collectMissingBlobs(sha, missing);
+        else if (entry.mode != "160000" && !objectExists(sha)) missing.push_back(sha);
+    }
+}
+
+// --- Pack Writing ---
+
+// Type and payload of an object as returned by readObject ("type size\0data")
+pair<int, string> readObjectPayload(const string& sha) {
+    string full = readObject(sha);
+    size_t space = full.find(' '), nullPos = full.find('\0');
+    return {typeFromString(full.substr(0, space)), full.substr(nullPos + 1)};
+}
+
+string encodePackEntryHeader(int type, size_t size) {
+    string header;
+    unsigned char b = (type << 4) | (size & 15);
+    size >>= 4;
+    while (size) {
+        header += (char)(b | 0x80);
+        b = size & 0x7F;
+        size >>= 7;
+    }
+    header += (char)b;
+    return header;
+}
+
+string deflateBytes(const string& data) {
+    uLongf compressedSize = compressBound(data.size());
+    string out(compressedSize, '\0');
+    if (compress((Bytef*)out.data(), &compressedSize, (const Bytef*)data.data(), data.size()) != Z_OK) {
+        throw runtime_error("Compression failed");
+    }
+    out.resize(compressedSize);
+    return out;
+}
+
+// Streams a version 2 pack holding `shas` to `out`. Objects listed in
+// `deltaBases` are stored as REF_DELTA against that base when the delta is
+// less than half the object's size, otherwise whole. A base need not be in
+// the pack (a thin pack), so only receivers that complete thin packs from
+// their own store may be sent one. Returns the number of entries written as
+// deltas.
+size_t writePack(const vector<string>& shas, const ByteSink& out, const map<string, string>& deltaBases = {}) {
+    Sha1Hasher hasher;
+    auto emit = [&](const string& bytes) {
+        hasher.update(bytes.data(), bytes.size());
+        out(bytes.data(), bytes.size());
+    };
+
+    string header = "PACK";
+    uint32_t count = shas.size();
+    header += string{0, 0, 0, 2};
+    header += string{(char)(count >> 24), (char)(count >> 16), (char)(count >> 8), (char)count};
+    emit(header);
+
+    size_t deltified = 0;
+    for (const auto& sha : shas) {
+        auto [type, data] = readObjectPayload(sha);
+        auto base = deltaBases.find(sha);
+        if (base != deltaBases.end()) {
+            string delta = createDelta(readObjectPayload(base->second).second, data);
+            if (delta.size() < data.size() / 2) {
+                emit(encodePackEntryHeader(7, delta.size()) + hexToSha(base->second) + deflateBytes(delta));
+                ++deltified;
+                continue;
+            }
+        }
+        emit(encodePackEntryHeader(type, data.size()) + deflateBytes(data));
+    }
+    if (!deltaBases.empty()) cerr << "[DEBUG] Wrote " << shas.size() << " objects, " << deltified << " as deltas" << endl;
+
+    string trailer = hasher.finish();
+    out(trailer.data(), trailer.size());
+    return deltified;
+}
+
+// Blob filters used by partial clones: "blob:none" or "blob:limit=<bytes>"
+bool filterExcludesBlob(const string& filter, const string& sha) {
+    if (filter.empty()) return false;
+    if (filter == "blob:none") return true;
+    if (filter.starts_with("blob:limit=")) {
+        return readObjectPayload(sha).second.size() >= parseByteSize(filter.substr(11));
+    }
+    throw runtime_error("Unsupported filter: " + filter);
+}
+
+void collectTreeObjects(const string& treeSha, const string& filter, set<string>& seen, vector<string>& out) {
+    if (!seen.insert(treeSha).second) return;
+    out.push_back(treeSha);
+    for (const auto& entry : parseTree(treeSha)) {
+        string sha = shaToHex(entry.shaRaw);
+        if (entry.mode == "40000") collectTreeObjects(sha, filter, seen, out);
+        else if (entry.mode == "160000") continue; // Submodule commits live in another repository
+        else if (!seen.count(sha) && !filterExcludesBlob(filter, sha)) {
+            seen.insert(sha);
+            out.push_back(sha);
+        }
+    }
+}
+
+struct PackPlan {
+    vector<string> objects; // Commits first, then trees and blobs
+    vector<string> shallow; // Commits sent without their parents (deepen)
+    vector<string> commits; // Commits in the pack, newest first
+};
+
+// Objects reachable from `wants` but not from `haves`. With `depth`, history
+// is cut `depth` commits below each want and the cut points are reported.
+PackPlan planPack(const vector<string>& wants, const vector<string>& haves, const string& filter, int depth) {
+    PackPlan plan;
+    set<string> seen;
+
+    // Trees of the common commits are on the other side already
+    vector<string> discard;
+    for (const auto& sha : haves) collectTreeObjects(parseCommit(sha).tree, "", seen, discard);
+
+    vector<string> commits, trees;
+    auto addCommit = [&](const string& sha, const CommitInfo& info) {
+        if (!seen.insert(sha).second) return;
+        commits.push_back(sha);
+        trees.push_back(info.tree);
+    };
+
+    vector<string> wantedCommits;
+    for (const auto& want : wants) {
+        string sha = want;
+        auto [type, data] = readObjectPayload(sha);
+        while (type == 4) { // Annotated tag: send it and follow its target
+            if (seen.insert(sha).second) plan.objects.push_back(sha);
+            sha = data.substr(7, 40); // "object <sha>"
+            tie(type, data) = readObjectPayload(sha);
+        }
+        if (type == 1) wantedCommits.push_back(sha);
+        else if (type == 2) trees.push_back(sha);
+        else if (seen.insert(sha).second) plan.objects.push_back(sha); // Explicitly wanted blobs ignore the filter
+    }
+
+    if (depth > 0) {
+        set<string> shallow = readShallow();
+        vector<pair<string, int>> queue;
+        for (const auto& sha : wantedCommits) queue.push_back({sha, 1});
+        for (size_t i = 0; i < queue.size(); ++i) {
+            auto [sha, level] = queue[i];
+            if (seen.count(sha)) continue;
+            CommitInfo info = parseCommit(sha);
+            addCommit(sha, info);
+            if (shallow.count(sha)) continue;
+            if (level >= depth) {
+                if (!info.parents.empty()) plan.shallow.push_back(sha);
+                continue;
+            }
+            for (const auto& parent : info.parents) queue.push_back({parent, level + 1});
+        }
+    } else {
+        RevWalk walk;
+        for (const auto& sha : wantedCommits) walk.push(sha);
+        for (const auto& sha : haves) {
+            walk.push(sha);
+            walk.markUninteresting(sha);
+        }
+        string sha;
+        CommitInfo info;
+        while (walk.next(sha, &info)) addCommit(sha, info);
+    }
+
+    plan.objects.insert(plan.objects.end(), commits.begin(), commits.end());
+    plan.commits = commits;
+    for (const auto& tree : trees) collectTreeObjects(tree, filter, seen, plan.objects);
+    return plan;
+}
+
+// Picks a delta base for each tree and blob being sent: the object that
+// previously lived at the same path. Paths start out from the trees of
+// `haves` and are replayed through the commits being sent, oldest first,
+// so most bases are objects the receiver already has. Bases always precede
+// their targets in this replay, which rules out delta cycles. A base is only
+// used if the receiver ends up with it: it is in the pack, or reachable from
+// `haves` and not a blob that `filter` keeps from the receiver. It must also
+// be of the same type, since a REF_DELTA takes its type from the base.
+map<string, string> findDeltaBases(const PackPlan& plan, const vector<string>& haves, const string& filter = "") {
+    set<string> sending(plan.objects.begin(), plan.objects.end());
+    set<string> haveObjects; // Reachable from `haves`
+    map<string, pair<string, bool>> byPath; // Path -> {sha, is a tree}
+    map<string, string> bases;
+    set<string> placed;
+
+    auto usableBase = [&](const string& sha, bool isTree) {
+        if (sending.count(sha)) return true;
+        return haveObjects.count(sha) && (isTree || !filterExcludesBlob(filter, sha));
+    };
+    function<void(const string&, const string&, bool)> visit = [&](const string& treeSha, const string& prefix, bool replay) {
+        for (const auto& entry : parseTree(treeSha)) {
+            if (entry.mode == "160000") continue;
+            string sha = shaToHex(entry.shaRaw), path = prefix + entry.name;
+            bool isTree = entry.mode == "40000";
+            bool isNew = replay && sending.count(sha);
+            if (!replay) haveObjects.insert(sha);
+            if (isNew && placed.insert(sha).second) {
+                auto previous = byPath.find(path);
+                if (previous != byPath.end() && previous->second.first != sha && previous->second.second == isTree &&
+                    usableBase(previous->second.first, isTree)) {
+                    bases[sha] = previous->second.first;
+                }
+            }
+            byPath[path] = {sha, isTree};
+            // Unchanged subtrees leave the paths below them as they were
+            if (isTree && (!replay || isNew)) visit(sha, path + "/", replay);
+        }
+    };
+
+    string root; // Root trees have no path of their own
+    for (const auto& sha : haves) {
+        root = parseCommit(sha).tree;
+        haveObjects.insert(root);
+        visit(root, "", false);
+    }
+    for (auto it = plan.commits.rbegin(); it != plan.commits.rend(); ++it) {
+        string tree = parseCommit(*it).tree;
+        if (!sending.count(tree)) continue;
+        if (placed.insert(tree).second && !root.empty() && usableBase(root, true)) bases[tree] = root;
+        root = tree;
+        visit(tree, "", true);
+    }
+    return bases;
+}
+
+// --- Push ---
+
+const string zeroSha(40, '0');
+
+struct RefUpdate {
+    string name;   // Remote ref, e.g. "refs/heads/master"
+    string oldSha; // zeroSha when the ref is created
+    string newSha; // zeroSha when the ref is deleted
+    string error;  // Set from report-status when the remote refuses the update
+};
+
+// Client side of git-receive-pack over smart HTTP. receive-pack has no
+// protocol v2, so discovery parses the v0 advertisement. Packs are thin:
+// objects the remote already has serve as delta bases without being sent.
+class ReceivePackClient {
+public:
+    explicit ReceivePackClient(string url) : url(std::move(url)) {
+        if (isLocalUrl(this->url)) throw runtime_error("push is only supported over http(s): " + this->url);
+    }
+
+    void connect() {
+        cerr << "[DEBUG] Discovering receive-pack refs..." << endl;
+        bool sawService = false;
+        PktLineReader reader([&](PktType type, string_view pkt) {
+            if (type != PktType::Data) return;
+            string line = stripNewline(pkt);
+            if (!sawService && line.starts_with("# service=")) {
+                sawService = true;
+                return;
+            }
+            adv.parseLine(line);
+        });
+        httpGet(url + "/info/refs?service=git-receive-pack", {},
+                [&](const char* data, size_t len) { reader.feed(data, len); });
+        if (!sawService) throw runtime_error("Remote does not speak smart HTTP receive-pack");
+    }
+
+    const vector<RemoteRef>& refs() const { return adv.refs; }
+
+    // Sends the ref updates with a pack of everything the remote lacks, then
+    // records the remote's verdict for each ref in RefUpdate::error.
+    // Returns false if the remote failed to unpack the pack.
+    bool push(vector<RefUpdate>& updates) {
+        bool sideBand = adv.caps.count("side-band-64k");
+        string body;
+        for (size_t i = 0; i < updates.size(); ++i) {
+            string line = updates[i].oldSha + " " + updates[i].newSha + " " + updates[i].name;
+            if (i == 0) {
+                line += '\0';
+                line += "report-status";
+                if (sideBand) line += " side-band-64k";
+                line += " agent=codecrafters-git";
+            }
+            body += createPktLine(line + "\n");
+        }
+        body += "0000";
+
+        vector<string> wants, haves;
+        for (const auto& update : updates) {
+            if (update.newSha != zeroSha) wants.push_back(update.newSha);
+        }
+        for (const auto& ref : adv.refs) {
+            if (objectExists(ref.sha) && readObjectPayload(ref.sha).first == 1) haves.push_back(ref.sha);
+        }
+        if (!wants.empty()) { // A push that only deletes refs carries no pack
+            PackPlan plan = planPack(wants, haves, "", 0);
+            auto bases = findDeltaBases(plan, haves);
+            writePack(plan.objects, [&](const char* data, size_t len) { body.append(data, len); }, bases);
+        }
+        cerr << "[DEBUG] Sending " << body.size() << " bytes to receive-pack" << endl;
+
+        bool unpackOk = false;
+        map<string, RefUpdate*> byName;
+        for (auto& update : updates) byName[update.name] = &update;
+        // Handles one report-status pkt-line
+        auto onStatus = [&](PktType type, string_view pkt) {
+            if (type != PktType::Data) return;
+            string line = stripNewline(pkt);
+            if (line.starts_with("unpack ")) {
+                unpackOk = line == "unpack ok";
+                if (!unpackOk) cerr << "error: remote unpack failed: " << line.substr(7) << "\n";
+            } else if (line.starts_with("ng ")) {
+                size_t space = line.find(' ', 3);
+                auto it = byName.find(line.substr(3, space - 3));
+                if (it != byName.end()) it->second->error = space == string::npos ? "rejected" : line.substr(space + 1);
+            }
+        };
+        // With side-band, channel 1 carries the report-status pkt-lines;
+        // without it, the response pkt-lines are the report itself
+        PktLineReader status(onStatus);
+        PktLineReader reader([&](PktType type, string_view pkt) {
+            if (sideBand) {
+                if (type == PktType::Data) demuxSideBand(pkt, [&](const char* data, size_t len) { status.feed(data, len); });
+            } else {
+                onStatus(type, pkt);
+            }
+        });
+        httpPost(url + "/git-receive-pack", body, "application/x-git-receive-pack-request", {},
+                 [&](const char* data, size_t len) { reader.feed(data, len); });
+        if (!unpackOk) {
+            for (auto& update : updates) {
+                if (update.error.empty()) update.error = "unpacker error";
+            }
+        }
+        return unpackOk;
+    }
+
+private:
+    string url;
+    V0Advertisement adv;
+};
+
+// True if `ancestor` is reachable from `sha`
+bool isAncestor(const string& ancestor, const string& sha) {
+    RevWalk walk;
+    walk.push(sha);
+    string current;
+    while (walk.next(current, nullptr)) {
+        if (current == ancestor) return true;
+    }
+    return false;
+}
+
+// --- Upload Pack Server ---
+
+// Blocking pkt-line read for the server side. Returns false on a clean EOF.
+bool readPktLine(int fd, PktType& type, string& payload) {
+    auto readExact = [&](char* buf, size_t len) {
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = read(fd, buf + got, len - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw runtime_error(string("read failed: ") + strerror(errno));
+            if (n == 0) {
+                if (got == 0) return false;
+                throw runtime_error("Unexpected EOF inside pkt-line");
+            }
+            got += n;
+        }
+        return true;
+    };
+
+    char lenHex[5] = {0};
+    if (!readExact(lenHex, 4)) return false;
+    size_t len = stoul(lenHex, nullptr, 16);
+    payload.clear();
+    if (len < 4) {
+        type = len == 0 ? PktType::Flush : len == 1 ? PktType::Delim : PktType::ResponseEnd;
+        return true;
+    }
+    type = PktType::Data;
+    payload.resize(len - 4);
+    if (!readExact(payload.data(), payload.size())) throw runtime_error("Unexpected EOF inside pkt-line");
+    return true;
+}
+
+// Serves protocol v2 upload-pack for the repository in gitDir: a capability
+// advertisement, then ls-refs and fetch commands until the client hangs up.
+class UploadPackServer {
+public:
+    // Pulls the next request packet; returns false when the client is gone
+    using PktSource = function<bool(PktType&, string&)>;
+
+    explicit UploadPackServer(ByteSink out) : out(std::move(out)) {}
+
+    void advertise() {
+        send("version 2\n");
+        send("agent=codecrafters-git\n");
+        send("ls-refs\n");
+        send("fetch=shallow filter\n");
+        send("object-format=sha1\n");
+        out("0000", 4);
+    }
+
+    // Handles one command; returns false once the client has closed the connection
+    bool serveCommand(const PktSource& next) {
+        PktType type;
+        string line, command;
+        vector<string> args;
+        bool inArgs = false;
+        while (true) {
+            if (!next(type, line)) return false;
+            if (type == PktType::Flush) break;
+            if (type == PktType::Delim) { inArgs = true; continue; }
+            line = stripNewline(line);
+            if (!inArgs) {
+                if (line.starts_with("command=")) command = line.substr(8);
+            } else {
+                args.push_back(line);
+            }
+        }
+        if (command.empty()) return true; // Bare flush: nothing to do
+
+        if (command == "ls-refs") lsRefs(args);
+        else if (command == "fetch") fetch(args);
+        else send("ERR unknown command " + command + "\n");
+        return true;
+    }
+
+private:
+    void send(const string& data) {
+        string pkt = createPktLine(data);
+        out(pkt.data(), pkt.size());
+    }
+
+    void sendSideBand(char channel, const char* data, size_t len) {
+        const size_t maxPayload = 65520 - 5; // 64k frame minus length and channel byte
+        while (len > 0) {
+            size_t chunk = min(len, maxPayload);
+            char lenHex[5];
+            snprintf(lenHex, sizeof(lenHex), "%04zx", chunk + 5);
+            string frame = string(lenHex, 4) + channel;
+            frame.append(data, chunk);
+            out(frame.data(), frame.size());
+            data += chunk;
+            len -= chunk;
+        }
+    }
+
+    void lsRefs(const vector<string>& args) {
+        bool symrefs = false, peel = false;
+        vector<string> prefixes;
+        for (const auto& arg : args) {
+            if (arg == "symrefs") symrefs = true;
+            else if (arg == "peel") peel = true;
+            else if (arg.starts_with("ref-prefix ")) prefixes.push_back(arg.substr(11));
+        }
+
+        auto emit = [&](const string& name, const string& sha, const string& target) {
+            if (!prefixes.empty() && none_of(prefixes.begin(), prefixes.end(), [&](const string& p) { return name.starts_with(p); })) return;
+            string line = sha + " " + name;
+            if (symrefs && !target.empty()) line += " symref-target:" + target;
+            if (peel && readObject(sha).starts_with("tag ")) line += " peeled:" + readObjectPayload(sha).second.substr(7, 40);
+            send(line + "\n");
+        };
+
+        string headSha = resolveRef("HEAD");
+        if (!headSha.empty()) {
+            ifstream headFile(gitDir / "HEAD");
+            string head;
+            getline(headFile, head);
+            emit("HEAD", headSha, head.starts_with("ref: ") ? head.substr(5) : "");
+        }
+        for (const auto& [name, sha] : readRefs()) emit(name, sha, "");
+        out("0000", 4);
+    }
+
+    void fetch(const vector<string>& args) {
+        vector<string> wants, haves;
+        string filter;
+        int depth = 0;
+        bool done = false, progress = true, thin = false;
+        for (const auto& arg : args) {
+            if (arg.starts_with("want ")) wants.push_back(arg.substr(5, 40));
+            else if (arg.starts_with("have ")) {
+                string sha = arg.substr(5, 40);
+                // Only commits we actually have count as common history
+                if (objectExists(sha) && readObject(sha).starts_with("commit ")) haves.push_back(sha);
+            }
+            else if (arg == "done") done = true;
+            else if (arg == "no-progress") progress = false;
+            else if (arg == "thin-pack") thin = true;
+            else if (arg.starts_with("deepen ")) depth = stoi(arg.substr(7));
+            else if (arg.starts_with("filter ")) filter = arg.substr(7);
+        }
+
+        if (!done) {
+            send("acknowledgments\n");
+            if (haves.empty()) send("NAK\n");
+            for (const auto& sha : haves) send("ACK " + sha + "\n");
+            if (haves.empty()) {
+                out("0000", 4);
+                return;
+            }
+            // Any common commit is enough to build a pack for
+            send("ready\n");
+            out("0001", 4);
+        }
+
+        PackPlan plan = planPack(wants, haves, filter, depth);
+        if (depth > 0) {
+            send("shallow-info\n");
+            for (const auto& sha : plan.shallow) send("shallow " + sha + "\n");
+            out("0001", 4);
+        }
+
+        send("packfile\n");
+        if (progress) {
+            string msg = "Enumerating objects: " + to_string(plan.objects.size()) + ", done.\n";
+            sendSideBand(2, msg.data(), msg.size());
+        }
+        // A client that completes thin packs gets deltas against what it has
+        auto deltaBases = thin ? findDeltaBases(plan, haves, filter) : map<string, string>{};
+        size_t deltas = writePack(plan.objects, [&](const char* data, size_t len) { sendSideBand(1, data, len); }, deltaBases);
+        if (progress) {
+            string msg = "Total " + to_string(plan.objects.size()) + " (delta " + to_string(deltas) + ")\n";
+            sendSideBand(2, msg.data(), msg.size());
+        }
+        out("0000", 4);
+    }
+
+    ByteSink out;
+};
 
-    return sha1Raw;
+// Metadata directory of `dir`, which is either a working tree or a bare repository
+fs::path findGitDir(const fs::path& dir) {
+    if (fs::exists(dir / ".git")) return dir / ".git";
+    if (fs::exists(dir / "objects") && fs::exists(dir / "HEAD")) return dir;
+    throw runtime_error("Not a git repository: " + dir.string());
 }
 
-// Read and decompress an object (used by cat-file and ls-tree)
-string readObject(const string& sha) {
-    string dirName = sha.substr(0, 2);
-    string fileName = sha.substr(2);
-    fs::path filePath = ".git/objects/" + dirName + "/" + fileName;
+void openRepository(const fs::path& dir) {
+    gitDir = findGitDir(dir);
+}
 
-    if (!fs::exists(filePath)) throw runtime_error("Object not found: " + sha);
+// --- HTTP Server ---
+
+// Buffered reader over a connected socket
+class SocketReader {
+public:
+    explicit SocketReader(int fd) : fd(fd) {}
+
+    // Reads one CRLF-terminated line (without the terminator); false on EOF
+    bool readLine(string& line) {
+        while (true) {
+            size_t eol = buf.find("\r\n", pos);
+            if (eol != string::npos) {
+                line = buf.substr(pos, eol - pos);
+                pos = eol + 2;
+                return true;
+            }
+            if (!fill()) return false;
+        }
+    }
 
-    ifstream file(filePath, ios::binary);
-    if (!file.is_open()) throw runtime_error("Failed to open object file");
+    bool readExact(string& out, size_t len) {
+        while (buf.size() - pos < len) {
+            if (!fill()) return false;
+        }
+        out.append(buf, pos, len);
+        pos += len;
+        return true;
+    }
 
-    vector<char> compressed((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-    file.close();
+private:
+    bool fill() {
+        if (pos > 0) { buf.erase(0, pos); pos = 0; }
+        char chunk[65536];
+        ssize_t n;
+        do { n = recv(fd, chunk, sizeof(chunk), 0); } while (n < 0 && errno == EINTR);
+        if (n <= 0) return false;
+        buf.append(chunk, n);
+        return true;
+    }
 
-    z_stream zs = {0}; // Zero-init
-    if (inflateInit(&zs) != Z_OK) throw runtime_error("Failed to initialize zlib");
+    int fd;
+    string buf;
+    size_t pos = 0;
+};
 
-    zs.avail_in = compressed.size();
-    zs.next_in = reinterpret_cast<Bytef*>(compressed.data());
+struct HttpRequest {
+    string method, target, path, query;
+    map<string, string> headers; // Lower-cased names
+    string body;
 
-    vector<char> buffer(8192);
-    string decompressed;
-    int ret;
+    string header(const string& name) const {
+        auto it = headers.find(name);
+        return it == headers.end() ? "" : it->second;
+    }
+};
 
+// Reads one request from a keep-alive connection; false when the client is done
+bool readHttpRequest(SocketReader& reader, HttpRequest& req) {
+    string line;
     do {
-        zs.avail_out = buffer.size();
-        zs.next_out = reinterpret_cast<Bytef*>(buffer.data());
-        ret = inflate(&zs, Z_NO_FLUSH);
-        if (decompressed.size() < zs.total_out) {
-            decompressed.append(buffer.data(), zs.total_out - decompressed.size());
+        if (!reader.readLine(line)) return false;
+    } while (line.empty()); // Tolerate stray CRLFs between requests
+
+    stringstream requestLine(line);
+    string version;
+    requestLine >> req.method >> req.target >> version;
+    size_t q = req.target.find('?');
+    req.path = req.target.substr(0, q);
+    req.query = q == string::npos ? "" : req.target.substr(q + 1);
+
+    req.headers.clear();
+    while (reader.readLine(line) && !line.empty()) {
+        size_t colon = line.find(':');
+        if (colon == string::npos) continue;
+        string name = line.substr(0, colon), value = line.substr(colon + 1);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        value.erase(0, value.find_first_not_of(" \t"));
+        req.headers[name] = value;
+    }
+
+    req.body.clear();
+    if (req.header("transfer-encoding") == "chunked") {
+        while (reader.readLine(line)) {
+            size_t len = stoul(line, nullptr, 16);
+            if (len == 0) {
+                while (reader.readLine(line) && !line.empty()) {} // Trailers
+                break;
+            }
+            if (!reader.readExact(req.body, len) || !reader.readLine(line)) return false;
         }
-    } while (ret != Z_STREAM_END);
-    
-    inflateEnd(&zs);
-    return decompressed;
+    } else if (!req.header("content-length").empty()) {
+        if (!reader.readExact(req.body, stoull(req.header("content-length")))) return false;
+    }
+    return true;
 }
 
-// Struct to hold tree entries for sorting
-struct TreeEntry {
-    string name;
-    string mode;     // "100644" or "40000"
-    string shaRaw;   // 20-byte raw SHA
+// Streams a response body with chunked transfer encoding, coalescing small
+// writes (individual pkt-lines) into chunks of up to 64 KiB
+class ChunkedWriter {
+public:
+    explicit ChunkedWriter(int fd) : fd(fd) {}
 
-    // Sorting operator required by Git (sort by name)
-    bool operator<(const TreeEntry& other) const {
-        return name < other.name;
+    void write(const char* data, size_t len) {
+        buf.append(data, len);
+        if (buf.size() >= 65536) flush();
     }
-};
 
-// Recursive function to build trees
-string writeTree(const fs::path& directory) {
-    vector<TreeEntry> entries;
+    void finish() {
+        flush();
+        writeAll(fd, "0\r\n\r\n", 5);
+    }
 
-    for (const auto& entry : fs::directory_iterator(directory)) {
-        string name = entry.path().filename().string();
-        
-        // Ignore .git directory
-        if (name == ".git") continue;
+private:
+    void flush() {
+        if (buf.empty()) return;
+        char lenHex[20];
+        int n = snprintf(lenHex, sizeof(lenHex), "%zx\r\n", buf.size());
+        buf += "\r\n";
+        writeAll(fd, lenHex, n);
+        writeAll(fd, buf.data(), buf.size());
+        buf.clear();
+    }
 
-        TreeEntry te;
-        te.name = name;
+    int fd;
+    string buf;
+};
 
-        if (entry.is_directory()) {
-            te.mode = "40000";
-            // Recursively write the subdirectory tree
-            te.shaRaw = writeTree(entry.path());
+void sendHttpStatus(int fd, int code, const string& reason, const string& message) {
+    string response = "HTTP/1.1 " + to_string(code) + " " + reason + "\r\nContent-Type: text/plain\r\nContent-Length: " +
+                      to_string(message.size()) + "\r\n\r\n" + message;
+    writeAll(fd, response.data(), response.size());
+}
+
+// Smart HTTP for the repository in gitDir: GET <prefix>/info/refs and
+// POST <prefix>/git-upload-pack, with protocol v2 only. Read-only.
+void serveHttpRequest(int fd, const HttpRequest& req) {
+    bool v2 = req.header("git-protocol").find("version=2") != string::npos;
+    auto startResponse = [&](const string& contentType) {
+        string head = "HTTP/1.1 200 OK\r\nContent-Type: " + contentType +
+                      "\r\nCache-Control: no-cache\r\nTransfer-Encoding: chunked\r\n\r\n";
+        writeAll(fd, head.data(), head.size());
+    };
+
+    if (req.path.ends_with("/info/refs")) {
+        if (req.method != "GET") return sendHttpStatus(fd, 405, "Method Not Allowed", "GET required\n");
+        if (req.query.find("service=git-upload-pack") == string::npos) {
+            return sendHttpStatus(fd, 403, "Forbidden", "Only git-upload-pack is served\n");
+        }
+        startResponse("application/x-git-upload-pack-advertisement");
+        ChunkedWriter writer(fd);
+        ByteSink sink = [&](const char* data, size_t len) { writer.write(data, len); };
+        string service = createPktLine("# service=git-upload-pack\n") + "0000";
+        sink(service.data(), service.size());
+        if (v2) {
+            UploadPackServer(sink).advertise();
         } else {
-            te.mode = "100644"; // Assuming regular file
-            
-            // Read file content
-            ifstream file(entry.path(), ios::binary);
-            string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-            
-            // Write blob and get SHA
-            te.shaRaw = writeObject("blob", content);
+            string err = createPktLine("ERR this server requires protocol version 2\n");
+            sink(err.data(), err.size());
         }
-        entries.push_back(te);
-    }
-
-    // Sort entries alphabetically
-    sort(entries.begin(), entries.end());
-
-    // Construct the Tree Object content
-    string treeContent;
-    for (const auto& e : entries) {
-        // Format: <mode> <name>\0<20_byte_sha>
-        treeContent += e.mode + " " + e.name + '\0' + e.shaRaw;
+        writer.finish();
+    } else if (req.path.ends_with("/git-upload-pack")) {
+        if (req.method != "POST") return sendHttpStatus(fd, 405, "Method Not Allowed", "POST required\n");
+        if (!v2) return sendHttpStatus(fd, 400, "Bad Request", "Protocol version 2 required\n");
+
+        string encoding = req.header("content-encoding");
+        if (!encoding.empty() && encoding != "gzip" && encoding != "x-gzip") {
+            return sendHttpStatus(fd, 415, "Unsupported Media Type", "Unsupported Content-Encoding: " + encoding + "\n");
+        }
+        string body = encoding.empty() ? req.body : gunzipBytes(req.body);
+
+        vector<pair<PktType, string>> packets;
+        PktLineReader parser([&](PktType type, string_view payload) { packets.push_back({type, string(payload)}); });
+        parser.feed(body.data(), body.size());
+        size_t next = 0;
+        auto source = [&](PktType& type, string& payload) {
+            if (next == packets.size()) return false;
+            tie(type, payload) = packets[next++];
+            return true;
+        };
+
+        startResponse("application/x-git-upload-pack-result");
+        ChunkedWriter writer(fd);
+        UploadPackServer server([&](const char* data, size_t len) { writer.write(data, len); });
+        server.serveCommand(source);
+        writer.finish();
+    } else {
+        sendHttpStatus(fd, 404, "Not Found", "Not found\n");
     }
-
-    // Write the tree object itself
-    return writeObject("tree", treeContent);
 }
 
-// --- Helper Functions ---
-
-string typeToString(int type) {
-    switch (type) {
-        case 1: return "commit";
-        case 2: return "tree";
-        case 3: return "blob";
-        case 4: return "tag";
-        case 6: return "ofs_delta";
-        case 7: return "ref_delta";
-        default: return "unknown";
+// Accepts connections forever, forking a worker per connection. Workers keep
+// the connection open for as many requests as the client sends.
+void runHttpServer(const string& host, int port) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) throw runtime_error(string("socket failed: ") + strerror(errno));
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) throw runtime_error("Invalid listen address: " + host);
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0) throw runtime_error(string("bind failed: ") + strerror(errno));
+    if (listen(listener, 128) != 0) throw runtime_error(string("listen failed: ") + strerror(errno));
+
+    socklen_t addrLen = sizeof(addr);
+    getsockname(listener, (sockaddr*)&addr, &addrLen);
+    cout << "Listening on http://" << host << ":" << ntohs(addr.sin_port) << "/" << endl;
+
+    signal(SIGCHLD, SIG_IGN); // Workers are reaped automatically
+    signal(SIGPIPE, SIG_IGN);
+    while (true) {
+        int conn = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            throw runtime_error(string("accept failed: ") + strerror(errno));
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            try {
+                SocketReader reader(conn);
+                HttpRequest req;
+                while (readHttpRequest(reader, req)) {
+                    serveHttpRequest(conn, req);
+                    if (req.header("connection") == "close") break;
+                }
+            } catch (const exception& e) {
+                cerr << "[ERROR] " << e.what() << endl;
+            }
+            _exit(0);
+        }
+        close(conn);
     }
 }
 
-void writeObjectWithSha(const string& content, const string& shaHex) {
-    string dirName = shaHex.substr(0, 2);
-    string fileName = shaHex.substr(2);
-    fs::path dirPath = ".git/objects/" + dirName;
-    if (!fs::exists(dirPath)) fs::create_directories(dirPath);
+// --- Local Clone ---
 
-    uLongf compressedSize = compressBound(content.size());
-    vector<Bytef> compressedData(compressedSize);
-    if (compress(compressedData.data(), &compressedSize, (const Bytef*)content.data(), content.size()) != Z_OK) {
-        throw runtime_error("Compression failed");
+// Hardlink `from` to `to`, falling back to a reflink and then a plain copy
+// when the two paths are on different filesystems (or links are not allowed)
+void linkOrCopy(const fs::path& from, const fs::path& to) {
+    if (link(from.c_str(), to.c_str()) == 0) return;
+    if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+        throw runtime_error("Failed to link " + from.string() + ": " + strerror(errno));
     }
 
-    ofstream outFile(dirPath / fileName, ios::binary);
-    outFile.write((const char*)compressedData.data(), compressedSize);
-    outFile.close();
+    FdGuard src(open(from.c_str(), O_RDONLY | O_CLOEXEC));
+    FdGuard dst(open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444));
+    if (src.fd < 0 || dst.fd < 0) throw runtime_error("Failed to copy " + from.string() + ": " + strerror(errno));
+    if (ioctl(dst.fd, FICLONE, src.fd) == 0) return;
+
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(src.fd, buf, sizeof(buf))) > 0) writeAll(dst.fd, buf, n);
+    if (n < 0) throw runtime_error("Failed to copy " + from.string() + ": " + strerror(errno));
 }
 
-// --- DEBUG ENABLED NETWORKING ---
+// Clone from a repository on this machine without going through the pack
+// protocol. Its object store is hardlinked into ours, or, when `shared`, used
+// in place through objects/info/alternates. Returns the source HEAD as
+// {symref target, commit}.
+pair<string, string> cloneLocal(const fs::path& srcDir, bool shared) {
+    fs::path srcGitDir = fs::canonical(findGitDir(srcDir));
+    fs::path srcObjects = srcGitDir / "objects";
+
+    // Read the source refs through the regular helpers
+    fs::path ourGitDir = gitDir;
+    gitDir = srcGitDir;
+    map<string, string> refs = readRefs();
+    string headSha = resolveRef("HEAD"), headRef;
+    ifstream headFile(gitDir / "HEAD");
+    string head;
+    if (getline(headFile, head) && head.starts_with("ref: ")) headRef = head.substr(5);
+    set<string> shallow = readShallow();
+    gitDir = ourGitDir;
+
+    fs::path objects = gitDir / "objects";
+    if (shared) {
+        fs::create_directories(objects / "info");
+        ofstream(objects / "info/alternates") << srcObjects.string() << "\n";
+        alternatesChanged = true;
+        cerr << "[DEBUG] Sharing objects with " << srcObjects << endl;
+    } else {
+        size_t files = 0;
+        for (const auto& entry : fs::recursive_directory_iterator(srcObjects)) {
+            if (!entry.is_regular_file()) continue;
+            fs::path rel = fs::relative(entry.path(), srcObjects);
+            string name = rel.filename().string();
+            if (name.starts_with("tmp_") || name.starts_with("tmp-")) continue; // In-progress writes
+
+            fs::path target = objects / rel;
+            fs::create_directories(target.parent_path());
+            if (rel == "info/alternates") {
+                // Relative alternates were relative to the source store
+                ifstream in(entry.path());
+                ofstream out(target);
+                string line;
+                while (getline(in, line)) {
+                    if (!line.empty() && line[0] != '#' && fs::path(line).is_relative()) line = (srcObjects / line).lexically_normal().string();
+                    out << line << "\n";
+                }
+                continue;
+            }
+            if (!fs::exists(target)) linkOrCopy(entry.path(), target);
+            ++files;
+        }
+        cerr << "[DEBUG] Linked " << files << " object file(s) from " << srcObjects << endl;
+    }
 
-string httpGet(const string& url) {
-    cerr << "[DEBUG] GET Request: " << url << endl;
-    
-    // -f fails on HTTP 404/403 errors explicitly
-    string cmd = "curl -f -L -s \"" + url + "\" > response_output";
-    int ret = system(cmd.c_str());
-    
-    if (ret != 0) {
-        cerr << "[ERROR] HTTP GET failed. Command returned: " << ret << endl;
-        throw runtime_error("HTTP GET failed");
+    for (const auto& [name, sha] : refs) {
+        if (name.starts_with("refs/heads/")) updateRef("refs/remotes/origin/" + name.substr(11), sha);
+        else if (name.starts_with("refs/tags/")) updateRef(name, sha);
     }
-    
-    ifstream file("response_output", ios::binary);
-    string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-    cerr << "[DEBUG] Received " << content.size() << " bytes." << endl;
-    return content;
+    if (!shallow.empty()) writeShallow(shallow);
+    return {headRef, headSha};
 }
 
-string httpPost(const string& url, const string& data, const string& contentType) {
-    cerr << "[DEBUG] POST Request: " << url << endl;
-    
-    ofstream reqFile("request_body", ios::binary);
-    reqFile.write(data.data(), data.size());
-    reqFile.close();
+// --- Bundles ---
 
-    string cmd = "curl -f -L -s -X POST --data-binary @request_body -H \"Content-Type: " + contentType + "\" \"" + url + "\" > response_output";
-    int ret = system(cmd.c_str());
+// A v2 bundle is a text header followed by a pack:
+//   # v2 git bundle
+//   -<sha> [<comment>]   prerequisite commits the receiver must already have
+//   <sha> <refname>      refs the bundle provides
+//   <blank line>
+const string bundleSignature = "# v2 git bundle\n";
 
-    if (ret != 0) {
-        cerr << "[ERROR] HTTP POST failed. Command returned: " << ret << endl;
-        throw runtime_error("HTTP POST failed");
-    }
+struct BundleHeader {
+    vector<string> prerequisites;
+    vector<pair<string, string>> refs; // {refname, sha}
+};
 
-    ifstream file("response_output", ios::binary);
-    string content((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-    cerr << "[DEBUG] Received " << content.size() << " bytes." << endl;
-    return content;
+bool isBundleFile(const fs::path& path) {
+    ifstream file(path, ios::binary);
+    string start(bundleSignature.size(), '\0');
+    return file.read(start.data(), start.size()) && start == bundleSignature;
 }
 
-// --- Packfile Helpers ---
+// Leaves `in` positioned at the start of the pack
+BundleHeader readBundleHeader(istream& in) {
+    string line;
+    if (!getline(in, line) || line + "\n" != bundleSignature) throw runtime_error("Not a v2 git bundle");
+    BundleHeader header;
+    while (getline(in, line) && !line.empty()) {
+        if (line[0] == '-') header.prerequisites.push_back(line.substr(1, 40));
+        else if (line.size() > 41) header.refs.push_back({line.substr(41), line.substr(0, 40)});
+        else throw runtime_error("Malformed bundle header line: " + line);
+    }
+    if (!in) throw runtime_error("Bundle header is truncated");
+    return header;
+}
 
-string createPktLine(const string& data) {
-    stringstream ss;
-    ss << hex << setfill('0') << setw(4) << (data.size() + 4);
-    return ss.str() + data;
+// Writes `refs` and everything reachable from them, except what is reachable
+// from `exclude`; the excluded commits become prerequisites. Trees and blobs
+// are deltified against earlier versions at the same path, as for push.
+void writeBundle(const fs::path& path, const vector<pair<string, string>>& refs, const vector<string>& exclude) {
+    vector<string> wants;
+    for (const auto& [name, sha] : refs) wants.push_back(sha);
+    PackPlan plan = planPack(wants, exclude, "", 0);
+    if (plan.objects.empty()) throw runtime_error("Refusing to create an empty bundle");
+
+    fs::path tmpPath = path.string() + ".lock";
+    ofstream out(tmpPath, ios::binary);
+    out << bundleSignature;
+    for (const auto& sha : exclude) out << "-" << sha << "\n";
+    for (const auto& [name, sha] : refs) out << sha << " " << name << "\n";
+    out << "\n";
+    writePack(plan.objects, [&](const char* data, size_t len) { out.write(data, len); }, findDeltaBases(plan, exclude));
+    out.close();
+    if (!out) throw runtime_error("Failed to write " + tmpPath.string());
+    fs::rename(tmpPath, path);
+    cerr << "[DEBUG] Bundled " << plan.objects.size() << " objects and " << refs.size() << " ref(s)" << endl;
 }
 
-pair<string, size_t> decompressZlibStream(const string& data, size_t offset) {
-    z_stream zs = {};
-    zs.avail_in = data.size() - offset;
-    zs.next_in = (Bytef*)(data.data() + offset);
-    if (inflateInit(&zs) != Z_OK) throw runtime_error("zlib init failed");
+// Parses a bundle fed in arbitrary chunks: the header is buffered, then the
+// pack is streamed into a PackReceiver
+class BundleReceiver {
+public:
+    // `spool`, if given, is a file holding the whole bundle by the time
+    // finish() runs; the pack parser resolves deltas from it directly
+    // rather than spooling a second copy of the pack
+    explicit BundleReceiver(fs::path spool = {}) : spool(std::move(spool)) {}
+
+    void feed(const char* data, size_t len) {
+        if (headerDone) {
+            pack.feed(data, len);
+            return;
+        }
+        headerBuf.append(data, len);
+        size_t end = headerBuf.find("\n\n");
+        if (end == string::npos) {
+            size_t n = min(headerBuf.size(), bundleSignature.size());
+            if (headerBuf.compare(0, n, bundleSignature, 0, n) != 0) throw runtime_error("Not a v2 git bundle");
+            return;
+        }
+        istringstream in(headerBuf.substr(0, end + 2));
+        header = readBundleHeader(in);
+        for (const auto& sha : header.prerequisites) {
+            if (!objectExists(sha)) throw runtime_error("Repository lacks bundle prerequisite " + sha);
+        }
+        headerDone = true;
+        if (!spool.empty()) pack.useSpool(spool, end + 2);
+        size_t packStart = end + 2 - (headerBuf.size() - len); // Offset in this chunk
+        headerBuf.clear();
+        if (packStart < len) pack.feed(data + packStart, len - packStart);
+    }
 
-    char buffer[4096];
-    string result;
-    int ret;
-    do {
-        zs.avail_out = sizeof(buffer);
-        zs.next_out = (Bytef*)buffer;
-        ret = inflate(&zs, Z_NO_FLUSH);
-        result.append(buffer, sizeof(buffer) - zs.avail_out);
-    } while (ret != Z_STREAM_END && ret != Z_BUF_ERROR && ret != Z_DATA_ERROR);
+    void finish() {
+        if (!headerDone) throw runtime_error("Bundle header is truncated");
+        pack.finish();
+    }
 
-    size_t consumed = zs.total_in;
-    inflateEnd(&zs);
-    return {result, consumed};
-}
+    BundleHeader header;
+    PackReceiver pack;
 
-string applyDelta(const string& base, const string& delta) {
-    size_t pos = 0;
-    size_t srcSize = 0, shift = 0;
-    while (pos < delta.size()) {
-        unsigned char b = delta[pos++];
-        srcSize |= (b & 0x7f) << shift;
-        shift += 7;
-        if (!(b & 0x80)) break;
-    }
-    size_t targetSize = 0; shift = 0;
-    while (pos < delta.size()) {
-        unsigned char b = delta[pos++];
-        targetSize |= (b & 0x7f) << shift;
-        shift += 7;
-        if (!(b & 0x80)) break;
+private:
+    fs::path spool;
+    string headerBuf;
+    bool headerDone = false;
+};
+
+const int maxDownloadAttempts = 6;
+
+// Downloads `url` into the `spool` file, passing every byte to `sink` exactly
+// once. A dropped or stalled transfer is resumed from the end of the spool
+// with an HTTP range request, up to maxDownloadAttempts times with
+// exponential backoff. Bytes already spooled by an interrupted earlier run
+// are replayed from disk first, so only the remainder is downloaded.
+void downloadResumable(const string& url, const fs::path& spool, const ByteSink& sink) {
+    size_t have = 0;
+    if (fs::exists(spool)) {
+        ifstream in(spool, ios::binary);
+        vector<char> chunk(1 << 20);
+        while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0) {
+            sink(chunk.data(), in.gcount());
+            have += in.gcount();
+        }
+        cerr << "[DEBUG] Replayed " << have << " spooled bytes; resuming download" << endl;
     }
 
-    string result;
-    result.reserve(targetSize);
-    while (pos < delta.size()) {
-        unsigned char cmd = delta[pos++];
-        if (cmd & 0x80) { // Copy
-            size_t copyOff = 0, copySize = 0;
-            if (cmd & 0x01) copyOff |= (unsigned char)delta[pos++];
-            if (cmd & 0x02) copyOff |= (unsigned char)delta[pos++] << 8;
-            if (cmd & 0x04) copyOff |= (unsigned char)delta[pos++] << 16;
-            if (cmd & 0x08) copyOff |= (unsigned char)delta[pos++] << 24;
-            if (cmd & 0x10) copySize |= (unsigned char)delta[pos++];
-            if (cmd & 0x20) copySize |= (unsigned char)delta[pos++] << 8;
-            if (cmd & 0x40) copySize |= (unsigned char)delta[pos++] << 16;
-            if (copySize == 0) copySize = 0x10000;
-            result.append(base.substr(copyOff, copySize));
-        } else if (cmd > 0) { // Insert
-            result.append(delta.substr(pos, cmd));
-            pos += cmd;
+    ofstream out(spool, ios::binary | ios::app);
+    HttpSession& session = httpSessionFor(url);
+    for (int attempt = 1;; ++attempt) {
+        size_t skip = 0;    // Bytes to drop if the server ignores the range
+        bool first = true, sinkFailed = false;
+        try {
+            session.request(url, nullptr, "", {}, [&](const char* data, size_t len) {
+                if (first) {
+                    first = false;
+                    if (have > 0 && session.responseCode() != 206) skip = have; // Full body again
+                }
+                size_t drop = min(skip, len);
+                skip -= drop;
+                data += drop;
+                len -= drop;
+                if (len == 0) return;
+                out.write(data, len);
+                if (!out) throw runtime_error("Failed to write " + spool.string());
+                try {
+                    sink(data, len);
+                } catch (...) {
+                    sinkFailed = true; // Corrupt data, not a network problem
+                    throw;
+                }
+                have += len;
+            }, have);
+            out.flush();
+            return;
+        } catch (const exception& e) {
+            out.flush();
+            long status = session.responseCode();
+            if (status == 416 && have > 0) return; // Everything was spooled before the interruption
+            if (sinkFailed || (status >= 400 && status != 416) || attempt == maxDownloadAttempts) throw;
+            cerr << "[DEBUG] Download interrupted at byte " << have << " (" << e.what() << "), retry "
+                 << attempt << "/" << maxDownloadAttempts - 1 << endl;
+            sleep(1u << (attempt - 1));
         }
     }
-    return result;
 }
 
-struct PackObject {
-    int type;
-    string data, sha, baseSha;
-    size_t offset, baseOffset = 0;
-};
-
-void checkoutRecursive(const string& treeSha, const fs::path& dir) {
-    string content = readObject(treeSha);
-    size_t nullPos = content.find('\0');
-    string body = content.substr(nullPos + 1);
-
-    size_t i = 0;
-    while (i < body.size()) {
-        size_t spacePos = body.find(' ', i);
-        size_t nullPos = body.find('\0', spacePos);
-        string mode = body.substr(i, spacePos - i);
-        string name = body.substr(spacePos + 1, nullPos - (spacePos + 1));
-        string shaRaw = body.substr(nullPos + 1, 20);
-        i = nullPos + 1 + 20;
+// Unpacks the bundle at `uri` (an http(s) URL or a local path). Remote
+// bundles are spooled to objects/pack/tmp_bundle_<hash>; a .progress file
+// next to it records the source URL, so rerunning the same command after an
+// interruption replays the spool and picks up where the download stopped.
+BundleHeader fetchBundle(const string& uri) {
+    if (isLocalUrl(uri)) {
+        fs::path path = uri.starts_with("file://") ? uri.substr(7) : uri;
+        BundleReceiver receiver(path);
+        ifstream in(path, ios::binary);
+        if (!in) throw runtime_error("Cannot open bundle " + uri);
+        vector<char> chunk(1 << 20);
+        while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0) receiver.feed(chunk.data(), in.gcount());
+        receiver.finish();
+        return receiver.header;
+    }
 
-        string entrySha = shaToHex(shaRaw);
-        fs::path entryPath = dir / name;
+    Sha1Hasher hasher;
+    hasher.update(uri.data(), uri.size());
+    fs::path packDir = gitDir / "objects/pack";
+    fs::create_directories(packDir);
+    fs::path spool = packDir / ("tmp_bundle_" + shaToHex(hasher.finish()).substr(0, 16));
+    fs::path progress = spool.string() + ".progress";
+    BundleReceiver receiver(spool); // The download spool doubles as the pack spool
+
+    // A spool without a .progress file naming this URL cannot be trusted
+    ifstream progressIn(progress);
+    string recordedUrl;
+    if (!getline(progressIn, recordedUrl) || recordedUrl != uri) fs::remove(spool);
+    progressIn.close();
+
+    fs::path tmp = progress.string() + ".lock";
+    ofstream(tmp) << uri << "\n";
+    fs::rename(tmp, progress);
+    downloadResumable(uri, spool, [&](const char* data, size_t len) { receiver.feed(data, len); });
+    receiver.finish();
+
+    // Every object is stored loose now
+    fs::remove(spool);
+    fs::remove(progress);
+    return receiver.header;
+}
 
-        if (mode == "40000") {
-            fs::create_directories(entryPath);
-            checkoutRecursive(entrySha, entryPath);
-        } else {
-            string blobFull = readObject(entrySha);
-            string blobData = blobFull.substr(blobFull.find('\0') + 1);
-            ofstream out(entryPath, ios::binary);
-            out << blobData;
+// Writes the refs of a freshly unpacked bundle as a clone of it would.
+// Returns the {symref target, commit} to check out.
+pair<string, string> applyBundleRefs(const BundleHeader& header) {
+    string headSha, headRef;
+    for (const auto& [name, sha] : header.refs) {
+        if (name == "HEAD") headSha = sha;
+    }
+    for (const auto& [name, sha] : header.refs) {
+        if (name.starts_with("refs/heads/")) {
+            updateRef("refs/remotes/origin/" + name.substr(11), sha);
+            // The bundle records HEAD by value; pick a branch that matches it
+            if (headRef.empty() && (headSha.empty() || sha == headSha)) {
+                headRef = name;
+                headSha = sha;
+            }
+        } else if (name.starts_with("refs/tags/")) {
+            updateRef(name, sha);
         }
     }
+    return {headRef, headSha};
 }
 
-// //
-
 // --- Main ---
 
 int main(int argc, char *argv[])
@@ -436,142 +3402,130 @@ int main(int argc, char *argv[])
             cout << shaToHex(rawSha) << endl;
 
         } else if (command == "clone") {
-            if (argc < 4) return EXIT_FAILURE;
-            string url = argv[2], dir = argv[3];
+            // Usage: clone [--depth <n>] [--filter=<spec>] [--bundle-uri=<uri>] [--shared] [--no-local] <url> <dir>
+            vector<string> positional;
+            int depth = 0;
+            string filter, bundleUri;
+            bool shared = false, noLocal = false;
+            for (int i = 2; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg == "--shared" || arg == "-s") {
+                    shared = true;
+                } else if (arg == "--no-local") {
+                    noLocal = true;
+                } else if (arg == "--depth" && i + 1 < argc) {
+                    depth = stoi(argv[++i]);
+                    if (depth <= 0) throw runtime_error("--depth must be a positive number");
+                } else if (arg.starts_with("--bundle-uri=")) {
+                    bundleUri = arg.substr(13);
+                } else if (arg.starts_with("--filter=")) {
+                    filter = arg.substr(9);
+                    if (filter != "blob:none" && !filter.starts_with("blob:limit=")) {
+                        throw runtime_error("Unsupported filter: " + filter);
+                    }
+                } else {
+                    positional.push_back(arg);
+                }
+            }
+            if (positional.size() < 2) return EXIT_FAILURE;
+            string url = positional[0], dir = positional[1];
+            bool fromBundle = isLocalUrl(url) ? !url.starts_with("file://") && fs::is_regular_file(url) && isBundleFile(url)
+                                              : fs::path(url).extension() == ".bundle";
+            if (fromBundle && (depth || !filter.empty() || shared || !bundleUri.empty())) {
+                throw runtime_error("--depth, --filter, --shared and --bundle-uri cannot be used with a bundle");
+            }
+            // A plain path (not file://) takes the hardlinking fast path unless the
+            // clone needs the protocol for --depth/--filter or --no-local was given
+            bool localFastPath = !fromBundle && isLocalUrl(url) && !url.starts_with("file://") && !noLocal && depth == 0 && filter.empty();
+            if (!bundleUri.empty() && localFastPath) throw runtime_error("--bundle-uri requires a remote URL");
+            if (!bundleUri.empty() && isLocalUrl(bundleUri)) bundleUri = fs::absolute(bundleUri).string();
+            if (shared && !localFastPath) throw runtime_error("--shared requires a local repository path");
+            // Local sources are resolved before we change into the new directory
+            if (isLocalUrl(url)) url = fs::absolute(url.starts_with("file://") ? url.substr(7) : url).string();
+            if (isLocalUrl(url) && fromBundle) url = fs::absolute(url).string();
 
             fs::create_directories(dir);
             fs::current_path(dir);
             fs::create_directories(".git/objects");
             fs::create_directories(".git/refs");
 
-            // 1. Discovery
-            cerr << "[DEBUG] Step 1: Fetching Refs..." << endl;
-            string refs = httpGet(url + "/info/refs?service=git-upload-pack");
-            string line, headSha;
-            stringstream ss(refs);
-            while(getline(ss, line)) {
-                // Debug print capability lines
-                // cerr << "[DEBUG] Ref Line: " << line << endl;
-                if (line.size() > 44 && (line.find("refs/heads/master") != string::npos || line.find("HEAD") != string::npos)) {
-                    // Check if the line starts with the "0000" flush packet
-                    if (line.substr(0, 4) == "0000") {
-                        headSha = line.substr(8, 40); // Skip 0000 + length (4 bytes)
-                    } else {
-                        headSha = line.substr(4, 40); // standard packet line, skip length only
-                    }
-                    
-                    if (line.find("refs/heads/master") != string::npos) break;
-                }
-            }
-            
-            if(headSha.empty()) {
-                cerr << "[FATAL] No HEAD found! Dumping raw refs response:" << endl;
-                cerr << refs << endl;
-                return EXIT_FAILURE;
-            }
-            cerr << "[DEBUG] HEAD is at: " << headSha << endl;
-            if (headSha.length() > 40) headSha = headSha.substr(0, 40);
-            ofstream(".git/HEAD") << "ref: refs/heads/master\n";
-
-            // 2. Request Pack
-            cerr << "[DEBUG] Step 2: Requesting Packfile..." << endl;
-            // Removed " no-progress" to match the working logic from previous stages
-            string req = createPktLine("want " + headSha + " no-progress\n") + "0000" + createPktLine("done\n");
-            string packData = httpPost(url + "/git-upload-pack", req, "application/x-git-upload-pack-request");
-
-            size_t pStart = packData.find("PACK");
-            if (pStart == string::npos) {
-                cerr << "[FATAL] Invalid pack response (No 'PACK' signature)." << endl;
-                cerr << "[DEBUG] First 200 bytes of response:" << endl;
-                cerr << packData.substr(0, 200) << endl;
-                return EXIT_FAILURE;
+            // A filtered clone marks origin as a promisor so missing blobs are fetched on demand
+            ofstream config(".git/config");
+            config << "[core]\n\trepositoryformatversion = " << (filter.empty() ? 0 : 1) << "\n\tbare = false\n";
+            config << "[remote \"origin\"]\n\turl = " << url << "\n\tfetch = +refs/heads/*:refs/remotes/origin/*\n";
+            if (!filter.empty()) {
+                config << "\tpromisor = true\n\tpartialclonefilter = " << filter << "\n";
+                config << "[extensions]\n\tpartialclone = origin\n";
             }
-            packData = packData.substr(pStart);
-            cerr << "[DEBUG] Packfile found. Size: " << packData.size() << endl;
+            config.close();
+
+            string headSha, headRef = "refs/heads/master";
+            if (fromBundle) {
+                cerr << "[DEBUG] Cloning from bundle " << url << endl;
+                auto [bundleHeadRef, bundleHeadSha] = applyBundleRefs(fetchBundle(url));
+                headSha = bundleHeadSha;
+                if (!bundleHeadRef.empty()) headRef = bundleHeadRef;
+                if (headSha.empty()) {
+                    cerr << "[FATAL] Bundle has no branch to check out!" << endl;
+                    return EXIT_FAILURE;
+                }
+                ofstream(".git/HEAD") << "ref: " << headRef << "\n";
+                updateRef(headRef, headSha);
+            } else if (localFastPath) {
+                cerr << "[DEBUG] Cloning from local repository " << url << endl;
+                auto [srcHeadRef, srcHeadSha] = cloneLocal(url, shared);
+                headSha = srcHeadSha;
+                if (!srcHeadRef.empty()) headRef = srcHeadRef;
+                if (headSha.empty()) {
+                    cerr << "[FATAL] Source repository has no HEAD commit!" << endl;
+                    return EXIT_FAILURE;
+                }
+                ofstream(".git/HEAD") << "ref: " << headRef << "\n";
+                updateRef(headRef, headSha);
+            } else {
+                // 0. Seed the object store from a (resumable) bundle download
+                vector<string> bundleTips;
+                if (!bundleUri.empty()) {
+                    cerr << "[DEBUG] Step 0: Fetching bundle " << bundleUri << endl;
+                    for (const auto& [name, sha] : fetchBundle(bundleUri).refs) bundleTips.push_back(sha);
+                }
 
-            // 3. Parse Pack
-            // Correct: Reads Count (bytes 8-11), starts parsing at 12
-            size_t pos = 12; // Header is 12 bytes long
-            uint32_t numObjs = (unsigned char)packData[8] << 24 | (unsigned char)packData[9] << 16 | (unsigned char)packData[10] << 8 | (unsigned char)packData[11];
-            cerr << "[DEBUG] Number of objects: " << numObjs << endl;
-            
-            vector<PackObject> tempObjs;
-            for(uint32_t i=0; i<numObjs; ++i) {
-                PackObject obj;
-                obj.offset = pos;
-                unsigned char b = packData[pos++];
-                obj.type = (b >> 4) & 7;
-                size_t size = b & 15;
-                int shift = 4;
-                while(b & 0x80) {
-                    b = packData[pos++];
-                    size |= (b & 0x7F) << shift;
-                    shift += 7;
-                }
-                
-                if (obj.type == 6) { // OFS_DELTA
-                    b = packData[pos++];
-                    size_t neg = b & 0x7F;
-                    while(b & 0x80) { b = packData[pos++]; neg = ((neg+1) << 7) | (b & 0x7F); }
-                    obj.baseOffset = obj.offset - neg;
-                } else if (obj.type == 7) { // REF_DELTA
-                    obj.baseSha = shaToHex(string(packData.data()+pos, 20));
-                    pos += 20;
-                }
-                
-                auto [dec, cons] = decompressZlibStream(packData, pos);
-                obj.data = dec;
-                pos += cons;
-                tempObjs.push_back(obj);
-            }
-
-            // 4. Resolve Deltas
-            cerr << "[DEBUG] Resolving Deltas..." << endl;
-            map<string, PackObject> objects;
-            map<size_t, string> offToSha;
-
-            for(auto& obj : tempObjs) {
-                if(obj.type < 6) {
-                    string tStr = typeToString(obj.type);
-                    string full = tStr + " " + to_string(obj.data.size()) + '\0' + obj.data;
-                    
-                    unsigned char hash[20];
-                    SHA1((const unsigned char*)full.data(), full.size(), hash);
-                    obj.sha = shaToHex(string((char*)hash, 20));
-
-                    writeObjectWithSha(full, obj.sha);
-                    objects[obj.sha] = obj;
-                    offToSha[obj.offset] = obj.sha;
+                // 1. Discovery: only ask for HEAD (and the branch it points to)
+                cerr << "[DEBUG] Step 1: Fetching Refs..." << endl;
+                UploadPackClient remote(url);
+                remote.connect();
+                for (const auto& ref : remote.lsRefs({"HEAD"})) {
+                    if (ref.name != "HEAD") continue;
+                    headSha = ref.sha;
+                    if (!ref.symrefTarget.empty()) headRef = ref.symrefTarget;
                 }
-            }
-            
-            bool progress = true;
-            while(progress) {
-                progress = false;
-                for(auto& obj : tempObjs) {
-                    if(!obj.sha.empty()) continue;
-                    
-                    string baseSha;
-                    if(obj.type == 6 && offToSha.count(obj.baseOffset)) baseSha = offToSha[obj.baseOffset];
-                    else if(obj.type == 7) baseSha = obj.baseSha;
-                    
-                    if(!baseSha.empty() && objects.count(baseSha)) {
-                        obj.data = applyDelta(objects[baseSha].data, obj.data);
-                        obj.type = objects[baseSha].type;
-                        
-                        string tStr = typeToString(obj.type);
-                        string full = tStr + " " + to_string(obj.data.size()) + '\0' + obj.data;
-                        
-                        unsigned char hash[20];
-                        SHA1((const unsigned char*)full.data(), full.size(), hash);
-                        obj.sha = shaToHex(string((char*)hash, 20));
-
-                        writeObjectWithSha(full, obj.sha);
-                        objects[obj.sha] = obj;
-                        offToSha[obj.offset] = obj.sha;
-                        progress = true;
-                    }
+
+                if (headSha.empty()) {
+                    cerr << "[FATAL] No HEAD found in remote refs!" << endl;
+                    return EXIT_FAILURE;
                 }
+                cerr << "[DEBUG] HEAD is at: " << headSha << " (" << headRef << ")" << endl;
+                ofstream(".git/HEAD") << "ref: " << headRef << "\n";
+                updateRef(headRef, headSha);
+                if (headRef.starts_with("refs/heads/")) updateRef("refs/remotes/origin/" + headRef.substr(11), headSha);
+
+                // 2. Request Pack and parse it while it downloads
+                cerr << "[DEBUG] Step 2: Requesting Packfile..." << endl;
+                PackReceiver pack;
+                FetchResult fetched;
+                if (bundleTips.empty()) fetched = remote.fetch({{headSha}, depth, filter}, pack);
+                else if (!objectExists(headSha)) fetched = negotiateFetch(remote, {{headSha}, depth, filter}, bundleTips, pack);
+                else cerr << "[DEBUG] Bundle already contains HEAD" << endl;
+                if (!fetched.shallow.empty()) {
+                    set<string> shallow = readShallow();
+                    shallow.insert(fetched.shallow.begin(), fetched.shallow.end());
+                    for (const auto& sha : fetched.unshallow) shallow.erase(sha);
+                    writeShallow(shallow);
+                    cerr << "[DEBUG] Shallow clone: " << shallow.size() << " boundary commit(s)" << endl;
+                }
+
+                // 4. Resolve any deltas whose base arrived after them
+                if (bundleTips.empty() || fetched.gotPack) pack.finish();
             }
 
             // 5. Checkout
@@ -596,11 +3550,284 @@ int main(int argc, char *argv[])
 
             // D. Checkout using the specific Tree SHA
             if (!treeSha.empty()) {
+                if (!filter.empty()) {
+                    vector<string> missing;
+                    collectMissingBlobs(treeSha, missing);
+                    if (!missing.empty()) fetchMissingObjects(missing);
+                }
                 checkoutRecursive(treeSha, ".");
             } else {
                 cerr << "[FATAL] Could not find tree in HEAD commit." << endl;
                 return EXIT_FAILURE;
             }
+        } else if (command == "fetch") {
+            // Usage: fetch [<remote>]
+            string remoteName = argc > 2 ? argv[2] : "origin";
+            auto config = readConfig();
+            string url = config["remote." + remoteName + ".url"];
+            if (url.empty()) throw runtime_error("No URL configured for remote " + remoteName);
+
+            UploadPackClient remote(url);
+            remote.connect();
+            auto localRefs = readRefs();
+
+            FetchRequest req;
+            vector<pair<string, string>> updates; // tracking ref -> new sha
+            set<string> wanted;
+            for (const auto& ref : remote.lsRefs({"refs/heads/"})) {
+                string tracking = "refs/remotes/" + remoteName + "/" + ref.name.substr(11);
+                auto existing = localRefs.find(tracking);
+                if (existing != localRefs.end() && existing->second == ref.sha) continue;
+                updates.push_back({tracking, ref.sha});
+                if (!objectExists(ref.sha) && wanted.insert(ref.sha).second) req.wants.push_back(ref.sha);
+            }
+
+            if (!req.wants.empty()) {
+                vector<string> tips;
+                for (const auto& [name, sha] : localRefs) tips.push_back(sha);
+                string head = resolveRef("HEAD");
+                if (!head.empty()) tips.push_back(head);
+
+                set<string> shallow = readShallow();
+                req.shallow.assign(shallow.begin(), shallow.end());
+                req.filter = config["remote." + remoteName + ".partialclonefilter"];
+
+                PackReceiver pack;
+                FetchResult fetched = negotiateFetch(remote, req, tips, pack);
+                pack.finish();
+
+                if (!fetched.shallow.empty() || !fetched.unshallow.empty()) {
+                    shallow.insert(fetched.shallow.begin(), fetched.shallow.end());
+                    for (const auto& sha : fetched.unshallow) shallow.erase(sha);
+                    writeShallow(shallow);
+                }
+            }
+
+            for (const auto& [tracking, sha] : updates) {
+                auto existing = localRefs.find(tracking);
+                string old = existing != localRefs.end() ? existing->second.substr(0, 7) : "(new)";
+                cout << " " << old << ".." << sha.substr(0, 7) << "  " << tracking << "\n";
+                updateRef(tracking, sha);
+            }
+            if (updates.empty()) cout << "Already up to date.\n";
+
+        } else if (command == "push") {
+            // Usage: push [-f|--force] [<remote>] [<src>[:<dst>]]...
+            bool force = false;
+            vector<string> positional;
+            for (int i = 2; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg == "-f" || arg == "--force") force = true;
+                else positional.push_back(arg);
+            }
+            string remoteName = positional.empty() ? "origin" : positional[0];
+            string url = configValue("remote." + remoteName + ".url");
+            if (url.empty()) throw runtime_error("No URL configured for remote " + remoteName);
+
+            vector<string> refspecs(positional.size() > 1 ? positional.begin() + 1 : positional.end(), positional.end());
+            if (refspecs.empty()) {
+                ifstream headFile(gitDir / "HEAD");
+                string head;
+                getline(headFile, head);
+                if (!head.starts_with("ref: refs/heads/")) throw runtime_error("HEAD is detached; name the branch to push");
+                refspecs.push_back(head.substr(16));
+            }
+
+            ReceivePackClient remote(url);
+            remote.connect();
+            map<string, string> remoteRefs;
+            for (const auto& ref : remote.refs()) remoteRefs[ref.name] = ref.sha;
+
+            vector<RefUpdate> updates;
+            vector<string> rejected;
+            for (const auto& spec : refspecs) {
+                size_t colon = spec.find(':');
+                string src = spec.substr(0, colon), dst = colon == string::npos ? src : spec.substr(colon + 1);
+                if (!dst.starts_with("refs/")) dst = "refs/heads/" + dst;
+
+                RefUpdate update;
+                update.name = dst;
+                update.oldSha = remoteRefs.count(dst) ? remoteRefs[dst] : zeroSha;
+                if (src.empty()) {
+                    update.newSha = zeroSha;
+                } else {
+                    update.newSha = resolveRef(src.starts_with("refs/") ? src : "refs/heads/" + src);
+                    if (update.newSha.empty() && src.size() == 40 && objectExists(src)) update.newSha = src;
+                    if (update.newSha.empty()) throw runtime_error("src refspec " + src + " does not match any");
+                }
+
+                string label = (src.empty() ? "(delete)" : src) + " -> " + dst.substr(dst.starts_with("refs/heads/") ? 11 : 0);
+                if (update.oldSha == update.newSha) {
+                    cout << " = [up to date]      " << label << "\n";
+                } else if (!force && update.oldSha != zeroSha && update.newSha != zeroSha &&
+                           !(objectExists(update.oldSha) && isAncestor(update.oldSha, update.newSha))) {
+                    cout << " ! [rejected]        " << label << " (non-fast-forward)\n";
+                    rejected.push_back(dst);
+                } else {
+                    updates.push_back(update);
+                }
+            }
+
+            bool ok = rejected.empty();
+            if (!updates.empty()) {
+                cout << "To " << url << "\n";
+                remote.push(updates);
+                for (const auto& update : updates) {
+                    string label = update.name.substr(update.name.starts_with("refs/heads/") ? 11 : 0);
+                    if (!update.error.empty()) {
+                        cout << " ! [remote rejected] " << label << " (" << update.error << ")\n";
+                        ok = false;
+                        continue;
+                    }
+                    if (update.newSha == zeroSha) cout << " - [deleted]         " << label << "\n";
+                    else if (update.oldSha == zeroSha) cout << " * [new branch]      " << label << "\n";
+                    else cout << "   " << update.oldSha.substr(0, 7) << ".." << update.newSha.substr(0, 7) << "  " << label << "\n";
+
+                    if (!update.name.starts_with("refs/heads/")) continue;
+                    string tracking = "refs/remotes/" + remoteName + "/" + update.name.substr(11);
+                    if (update.newSha == zeroSha) fs::remove(gitDir / tracking);
+                    else updateRef(tracking, update.newSha);
+                }
+            }
+            if (!ok) throw runtime_error("failed to push some refs to " + url);
+
+        } else if (command == "bundle") {
+            // Usage: bundle create <file> (--all | <ref> | ^<commit>)...
+            if (argc < 5 || string(argv[2]) != "create") {
+                cerr << "Usage: bundle create <file> (--all | <ref> | ^<commit>)...\n";
+                return EXIT_FAILURE;
+            }
+            auto localRefs = readRefs();
+            vector<pair<string, string>> refs;
+            vector<string> exclude;
+            auto addRef = [&](const string& name, const string& sha) {
+                for (const auto& ref : refs) if (ref.first == name) return;
+                refs.push_back({name, sha});
+            };
+            for (int i = 4; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg == "--all") {
+                    if (string head = resolveRef("HEAD"); !head.empty()) addRef("HEAD", head);
+                    for (const auto& [name, sha] : localRefs) addRef(name, sha);
+                } else if (arg.starts_with("^")) {
+                    string rev = arg.substr(1), name = rev;
+                    if (name != "HEAD" && !name.starts_with("refs/")) {
+                        name = localRefs.count("refs/heads/" + rev) ? "refs/heads/" + rev : "refs/tags/" + rev;
+                    }
+                    string sha = rev.size() == 40 ? rev : resolveRef(name);
+                    if (sha.empty()) throw runtime_error("Unknown revision " + rev);
+                    // Prerequisites are commits, so an annotated tag is peeled
+                    string commit = peelToCommit(sha);
+                    if (commit.empty()) throw runtime_error("Not a commit: " + rev);
+                    exclude.push_back(commit);
+                } else {
+                    string name = arg;
+                    if (name != "HEAD" && !name.starts_with("refs/")) {
+                        name = localRefs.count("refs/heads/" + arg) ? "refs/heads/" + arg : "refs/tags/" + arg;
+                    }
+                    string sha = resolveRef(name);
+                    if (sha.empty()) throw runtime_error("Unknown ref " + arg);
+                    addRef(name, sha);
+                }
+            }
+            if (refs.empty()) throw runtime_error("No refs to bundle");
+            writeBundle(argv[3], refs, exclude);
+
+        } else if (command == "upload-pack") {
+            // Usage: upload-pack <directory>  (protocol v2 over stdin/stdout)
+            if (argc < 3) return EXIT_FAILURE;
+            openRepository(argv[2]);
+            UploadPackServer server([](const char* data, size_t len) { writeAll(STDOUT_FILENO, data, len); });
+            server.advertise();
+            auto next = [](PktType& type, string& payload) { return readPktLine(STDIN_FILENO, type, payload); };
+            while (server.serveCommand(next)) {}
+
+        } else if (command == "http-backend") {
+            // Usage: http-backend [--listen <addr>] [--port <n>] [<directory>]
+            string host = "127.0.0.1", dir = ".";
+            int port = 8080;
+            for (int i = 2; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg == "--listen" && i + 1 < argc) host = argv[++i];
+                else if (arg == "--port" && i + 1 < argc) port = stoi(argv[++i]);
+                else dir = arg;
+            }
+            openRepository(dir);
+            gitDir = fs::absolute(gitDir);
+            runHttpServer(host, port);
+
+        } else if (command == "delta-bench") {
+            // Usage: delta-bench <pack-file> [<iterations>]
+            // Times applyDelta over every delta in an indexed pack
+            if (argc < 3) return EXIT_FAILURE;
+            int iterations = argc > 3 ? stoi(argv[3]) : 10;
+            PackFile pack(argv[2]);
+            vector<pair<string, string>> deltas; // {base, delta}
+            for (size_t i = 0; i < pack.objectCount(); ++i) {
+                string base, delta;
+                if (pack.readDelta(pack.offsetAt(i), base, delta)) deltas.push_back({std::move(base), std::move(delta)});
+            }
+            if (deltas.empty()) throw runtime_error("Pack holds no deltas");
+
+            size_t targetBytes = 0, deltaBytes = 0;
+            for (const auto& [base, delta] : deltas) { // Warm-up pass
+                targetBytes += applyDelta(base, delta).size();
+                deltaBytes += delta.size();
+            }
+            volatile size_t sink = 0; // Keeps the calls from being optimized away
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i) {
+                for (const auto& [base, delta] : deltas) sink = sink + applyDelta(base, delta).size();
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            size_t applied = deltas.size() * iterations;
+            cout << deltas.size() << " deltas (" << deltaBytes << " delta bytes, " << targetBytes << " target bytes), "
+                 << iterations << " iterations\n";
+            cout << fixed << setprecision(1) << seconds * 1e9 / applied << " ns/delta, "
+                 << targetBytes * (double)iterations / seconds / (1 << 20) << " MiB/s of output\n";
+
+        } else if (command == "index-pack") {
+            // Usage: index-pack [--threads=<n>] <file.pack>
+            // Writes <file>.idx next to the pack and prints the pack checksum
+            unsigned threads = 0;
+            fs::path packPath;
+            for (int i = 2; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg.starts_with("--threads=")) threads = stoul(arg.substr(10));
+                else packPath = arg;
+            }
+            if (packPath.extension() != ".pack") throw runtime_error("usage: index-pack [--threads=<n>] <file.pack>");
+            PackReceiver pack(threads);
+            auto start = chrono::steady_clock::now();
+            pack.indexFile(packPath);
+            pack.writeIndex(fs::path(packPath).replace_extension(".idx"));
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cerr << "[DEBUG] Indexed " << pack.objectCount() << " objects in " << fixed << setprecision(2) << seconds << "s" << endl;
+            cout << shaToHex(pack.packChecksum()) << "\n";
+
+        } else if (command == "unpack-objects") {
+            // Usage: unpack-objects [--threads=<n>] < <file.pack>
+            // Stores every object of the pack on stdin as a loose object
+            unsigned threads = 0;
+            for (int i = 2; i < argc; ++i) {
+                string arg = argv[i];
+                if (arg.starts_with("--threads=")) threads = stoul(arg.substr(10));
+            }
+            PackReceiver pack(threads);
+            auto start = chrono::steady_clock::now();
+            char buf[65536];
+            while (cin.read(buf, sizeof(buf)) || cin.gcount() > 0) pack.feed(buf, cin.gcount());
+            pack.finish();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cerr << "[DEBUG] Unpacked " << pack.objectCount() << " objects in " << fixed << setprecision(2) << seconds << "s" << endl;
+
+        } else if (command == "rev-list") {
+            // Usage: rev-list <commit>...
+            if (argc < 3) return EXIT_FAILURE;
+            walkCommits(vector<string>(argv + 2, argv + argc), [](const string& sha, const CommitInfo&) {
+                cout << sha << "\n";
+            });
+
         } else {
             cerr << "Unknown command " << command << '\n';
             return EXIT_FAILURE;